@@ -7,9 +7,17 @@
 #include "opcode.h"
 
 static void add_patch(struct parse_data *state, unsigned pos, const char *name);
+static void add_sized_patch(struct parse_data *state, unsigned pos, const char *name,
+                            int width);
 static int data_string(struct parse_data *state);
 static int data_zeroes(struct parse_data *state);
 static int data_bytes(struct parse_data *state, int width);
+static int assemble_branch(struct parse_data *state, int opcode);
+static int assemble_push(struct parse_data *state);
+
+/* push isn't an opcode; the assembler picks the shortest encoding of its
+ * operand */
+#define ASM_PUSH    0x100
 
 static int data_string(struct parse_data *state);
 static int data_zeroes(struct parse_data *state);
@@ -24,9 +32,14 @@ struct mnemonic mnemonics[] = {
 
     {   op_stkdup,  "stkdup",   0 },
 
+    {   ASM_PUSH,   "push",     4 },
     {   op_pushb,   "pushb",    1 },
     {   op_pushs,   "pushs",    2 },
     {   op_pushw,   "pushw",    4 },
+    {   op_push0,   "push0",    0 },
+    {   op_push1,   "push1",    0 },
+    {   op_pushm1,  "pushm1",   0 },
+    {   op_pushnl,  "pushnl",   0 },
     {   op_readb,   "readb",    0 },
     {   op_reads,   "reads",    0 },
     {   op_readw,   "readw",    0 },
@@ -47,12 +60,23 @@ struct mnemonic mnemonics[] = {
     {   op_saychar, "saychar",  0 },
     {   op_saystr,  "saystr",   0 },
 
+    {   op_memcpy,  "memcpy",   0 },
+    {   op_memset,  "memset",   0 },
+    {   op_memcmp,  "memcmp",   0 },
+    {   op_memchr,  "memchr",   0 },
+
     {   op_call,    "call",     0 },
     {   op_ret,     "ret",      0 },
     {   op_jump,    "jump",     0 },
     {   op_jumprel, "jumprel",  0 },
     {   op_jz,      "jz",       0 },
     {   op_jnz,     "jnz",      0 },
+
+    {   op_getlocal, "getlocal", 1 },
+    {   op_setlocal, "setlocal", 1 },
+    {   op_getarg,  "getarg",   1 },
+    {   op_setarg,  "setarg",   1 },
+    {   op_tailcall, "tailcall", 0 },
     {   op_bad,     NULL,       0 }
 };
 
@@ -61,10 +85,18 @@ struct mnemonic mnemonics[] = {
  * GENERAL UTILITY                                                           *
  * ************************************************************************* */
 void add_patch(struct parse_data *state, unsigned pos, const char *name) {
+    add_sized_patch(state, pos, name, 4);
+}
+
+/* width is 1, 2 or 4 for the label's address in that many bytes, or -1 or
+ * -2 for the offset to it from the branch opcode at pos - 1 */
+void add_sized_patch(struct parse_data *state, unsigned pos, const char *name,
+                     int width) {
     struct backpatch *patch = malloc(sizeof(struct backpatch));
     if (!patch) return;
     patch->address = pos;
     patch->name = str_dup(name);
+    patch->width = width;
     patch->next = state->patches;
     state->patches = patch;
 }
@@ -83,6 +115,213 @@ void write_long(struct parse_data *state, uint32_t value) {
 }
 
 
+/* ************************************************************************* *
+ * BRANCHES                                                                  *
+ * ************************************************************************* */
+/* A jump, jz or jnz with an operand is assembled in the shortest form that
+ * reaches its target: the 8-bit or 16-bit relative opcode, or else a pushw
+ * of the target followed by the plain stack opcode. */
+#define LONG_BRANCH_SIZE 6
+
+static struct mnemonic* find_mnemonic(const char *name) {
+    struct mnemonic *m = mnemonics;
+    while (m->name && strcmp(m->name, name) != 0) {
+        ++m;
+    }
+    return m->name ? m : NULL;
+}
+
+static int is_branch(int opcode) {
+    return opcode == op_jump || opcode == op_jz || opcode == op_jnz;
+}
+
+/* An upper bound on the distance from the branch or push at the current
+ * token to the label name further down the file, assuming every branch and
+ * push in between takes its long form. Returns -1 if the label is not found before anything
+ * whose size can't be known yet, or if it is too far for a 16-bit offset. */
+static int forward_bound(struct parse_data *state, const char *name) {
+    struct token *here = state->here;
+    int size = LONG_BRANCH_SIZE;
+
+    skip_line(&here);
+    while (here && size <= INT16_MAX) {
+        if (here->type == tt_eol) {
+            here = here->next;
+            continue;
+        }
+        if (here->type != tt_identifier) return -1;
+
+        if (here->next && here->next->type == tt_colon) {
+            if (strcmp(here->text, name) == 0) return size;
+            here = here->next->next;
+            continue;
+        }
+
+        const char *text = here->text;
+        struct token *operand = here->next;
+        if (strcmp(text, ".string") == 0) {
+            if (!operand || operand->type != tt_string) return -1;
+            size += strlen(operand->text) + 1;
+        } else if (strcmp(text, ".zero") == 0) {
+            if (!operand || operand->type != tt_integer) return -1;
+            size += operand->i;
+        } else if (strcmp(text, ".byte") == 0 || strcmp(text, ".short") == 0
+                || strcmp(text, ".word") == 0) {
+            int width = text[1] == 'b' ? 1 : text[1] == 's' ? 2 : 4;
+            for (; operand && operand->type != tt_eol; operand = operand->next) {
+                size += width;
+            }
+        } else if (strcmp(text, ".define") != 0) {
+            struct mnemonic *m = find_mnemonic(text);
+            if (!m) return -1;
+            if (is_branch(m->opcode) && operand && operand->type != tt_eol) {
+                size += LONG_BRANCH_SIZE;
+            } else if (m->opcode == op_tailcall) {
+                size += 2;      /* and the ret written after it */
+            } else {
+                size += 1 + m->operand_size;
+            }
+        }
+        skip_line(&here);
+    }
+    return -1;
+}
+
+int assemble_branch(struct parse_data *state, int opcode) {
+    struct token *operand = state->here->next;
+    unsigned base = state->code_pos;
+    struct label_def *label = NULL;
+    long offset = 0;
+    int width = 4;
+
+    if (operand->type == tt_integer) {
+        offset = (long)operand->i - (long)base;
+    } else if (operand->type == tt_identifier) {
+        label = get_label(state, operand->text);
+        if (label) {
+            offset = (long)label->pos - (long)base;
+        }
+    } else {
+        parse_error(state, "bad operand type");
+        return 0;
+    }
+
+    if (operand->type == tt_identifier && !label) {
+        int bound = forward_bound(state, operand->text);
+        if (bound >= 0) {
+            width = bound <= INT8_MAX ? 1 : 2;
+        }
+    } else if (offset >= INT8_MIN && offset <= INT8_MAX) {
+        width = 1;
+    } else if (offset >= INT16_MIN && offset <= INT16_MAX) {
+        width = 2;
+    }
+
+    if (width == 4) {
+        write_byte(state, op_pushw);
+        if (operand->type == tt_identifier && !label) {
+            add_patch(state, ftell(state->out), operand->text);
+            write_long(state, -1);
+        } else {
+            write_long(state, base + offset);
+        }
+        write_byte(state, opcode);
+        return 1;
+    }
+
+    int short_op = opcode == op_jump ? op_jump8 : opcode == op_jz ? op_jz8 : op_jnz8;
+    write_byte(state, width == 1 ? short_op : short_op + 1);
+    if (!label && operand->type == tt_identifier) {
+        add_sized_patch(state, ftell(state->out), operand->text, -width);
+        offset = 0;
+    }
+    if (width == 1) {
+        write_byte(state, offset);
+    } else {
+        write_short(state, offset);
+    }
+    return 1;
+}
+
+
+/* ************************************************************************* *
+ * CONSTANTS                                                                 *
+ * ************************************************************************* */
+/* The bytes a signed LEB128 encoding of value takes, at most five. */
+static int varint_size(int32_t value) {
+    int size = 1;
+    while (size < 5 && (value < -64 || value > 63)) {
+        value >>= 7;
+        ++size;
+    }
+    return size;
+}
+
+static void write_varint(struct parse_data *state, int32_t value, int size) {
+    for (int i = 1; i < size; ++i) {
+        write_byte(state, (value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    write_byte(state, value & 0x7F);
+}
+
+/* Writes the shortest push of value. pushv only beats pushb and pushs for
+ * negative values and ones past 16 bits. */
+static void write_push(struct parse_data *state, uint32_t value) {
+    int varint = varint_size((int32_t)value);
+
+    switch (value) {
+        case 0:             write_byte(state, op_push0);    return;
+        case 1:             write_byte(state, op_push1);    return;
+        case 0xFFFFFFFF:    write_byte(state, op_pushm1);   return;
+        case '\n':          write_byte(state, op_pushnl);   return;
+    }
+    if (value <= 0xFF) {
+        write_byte(state, op_pushb);
+        write_byte(state, value);
+    } else if (value > 0xFFFF && varint < 4) {
+        write_byte(state, op_pushv);
+        write_varint(state, value, varint);
+    } else if (value <= 0xFFFF) {
+        write_byte(state, op_pushs);
+        write_short(state, value);
+    } else {
+        write_byte(state, op_pushw);
+        write_long(state, value);
+    }
+}
+
+int assemble_push(struct parse_data *state) {
+    struct token *operand = state->here->next;
+    struct label_def *label;
+
+    if (operand->type == tt_integer) {
+        write_push(state, operand->i);
+        return 1;
+    } else if (operand->type != tt_identifier) {
+        parse_error(state, "bad operand type");
+        return 0;
+    }
+    label = get_label(state, operand->text);
+    if (label) {
+        write_push(state, label->pos);
+        return 1;
+    }
+
+    /* a label further on is no further than its bound, so pushb or pushs
+     * will hold its address once it is known */
+    int bound = forward_bound(state, operand->text);
+    long highest = bound >= 0 ? (long)state->code_pos + bound : -1;
+    int width = highest < 0 || highest > 0xFFFF ? 4 : highest > 0xFF ? 2 : 1;
+    write_byte(state, width == 1 ? op_pushb : width == 2 ? op_pushs : op_pushw);
+    add_sized_patch(state, ftell(state->out), operand->text, width);
+    for (int i = 0; i < width; ++i) {
+        write_byte(state, 0xFF);
+    }
+    return 1;
+}
+
+
 /* ************************************************************************* *
  * DIRECTIVE PROCESSING                                                      *
  * ************************************************************************* */
@@ -378,11 +617,8 @@ int parse_tokens(struct token_list *list, const char *output_filename) {
         }
 
 
-        struct mnemonic *m = mnemonics;
-        while (m->name && strcmp(m->name, state.here->text) != 0) {
-            ++m;
-        }
-        if (m->name == NULL) {
+        struct mnemonic *m = find_mnemonic(state.here->text);
+        if (m == NULL) {
             parse_error(&state, "unknown mnemonic");
             continue;
         }
@@ -390,7 +626,44 @@ int parse_tokens(struct token_list *list, const char *output_filename) {
 #ifdef DEBUG
         printf("0x%08X %s/%d", code_pos, here->text, m->opcode);
 #endif
+        if (m->opcode == op_ret && state.call_end == state.code_pos) {
+            /* a call straight before a ret becomes a tail call; the ret
+             * stays for anything that jumps to it */
+            fseek(state.out, -1, SEEK_CUR);
+            fputc(op_tailcall, state.out);
+        }
+        if (is_branch(m->opcode) && state.here->next
+                && state.here->next->type != tt_eol) {
+            assemble_branch(&state, m->opcode);
+            skip_line(&state.here);
+            continue;
+        }
+        if (m->opcode == ASM_PUSH) {
+            if (!state.here->next || state.here->next->type == tt_eol) {
+                parse_error(&state, "expected operand");
+                continue;
+            }
+            assemble_push(&state);
+            skip_line(&state.here);
+            continue;
+        }
+        if ((m->opcode == op_pushb || m->opcode == op_pushs || m->opcode == op_pushw)
+                && state.here->next && state.here->next->type == tt_integer) {
+            /* a constant gets the shortest push of the same value; a label
+             * keeps the width written, so its operand can be patched */
+            uint32_t value = state.here->next->i;
+            write_push(&state, m->opcode == op_pushb ? value & 0xFF
+                             : m->opcode == op_pushs ? value & 0xFFFF : value);
+            skip_line(&state.here);
+            continue;
+        }
         write_byte(&state, m->opcode);
+        if (m->opcode == op_call) {
+            state.call_end = state.code_pos;
+        } else if (m->opcode == op_tailcall) {
+            /* for when the tail call has to be made as a call; see opcode.h */
+            write_byte(&state, op_ret);
+        }
 
         if (state.here->next && state.here->next->type != tt_eol) {
             if (m->operand_size == 0) {
@@ -459,10 +732,21 @@ int parse_tokens(struct token_list *list, const char *output_filename) {
         if (!label) {
             fprintf(stderr, "Undefined symbol %s.\n", patch->name);
             ++state.error_count;
-        } else {
+        } else if (patch->width > 0) {
             fseek(state.out, patch->address, SEEK_SET);
             uint32_t v = label->pos;
-            fwrite(&v, 4, 1, state.out);
+            fwrite(&v, patch->width, 1, state.out);
+        } else {
+            long offset = (long)label->pos - (long)patch->address + 1;
+            if (offset < (patch->width == -1 ? INT8_MIN : INT16_MIN)
+                    || offset > (patch->width == -1 ? INT8_MAX : INT16_MAX)) {
+                fprintf(stderr, "Branch to %s out of range.\n", patch->name);
+                ++state.error_count;
+            } else {
+                int16_t v = offset;
+                fseek(state.out, patch->address, SEEK_SET);
+                fwrite(&v, -patch->width, 1, state.out);
+            }
         }
         struct backpatch *next = patch->next;
         free(patch->name);
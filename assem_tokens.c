@@ -190,9 +190,19 @@ struct token_list* lex_file(const char *filename) {
                 a_token = new_token(tt_colon, NULL, &state);
                 add_token(tokens, a_token);
                 in = next_char(fp, &state);
-            } else if (isdigit(in)) {
+            } else if (isdigit(in) || in == '-') {
                 struct lexer_state start = state;
                 buf_pos = 0;
+                if (in == '-') {
+                    token_buf[buf_pos] = in;
+                    ++buf_pos;
+                    in = next_char(fp, &state);
+                    if (!isdigit(in)) {
+                        lexer_error(&start, "expected digit after '-'");
+                        has_errors = 1;
+                        continue;
+                    }
+                }
                 while (isdigit(in)) {
                     token_buf[buf_pos] = in;
                     ++buf_pos;
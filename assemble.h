@@ -59,6 +59,8 @@ struct map_data {
 
 struct backpatch {
     unsigned address;
+    int width;              /* bytes of address, or minus the bytes of a
+                             * branch offset from the opcode just before it */
     char *name;
 
     struct backpatch *next;
@@ -73,6 +75,7 @@ struct parse_data {
     struct backpatch *patches;
     char tile_mapping[256];
     struct label_def *first_label;
+    unsigned call_end;      /* code_pos just past the last call */
 };
 
 
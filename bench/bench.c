@@ -0,0 +1,256 @@
+#define _POSIX_C_SOURCE 199309L
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "toyvm.h"
+
+/* ************************************************************************* *
+ * BENCHMARK HARNESS                                                         *
+ * ************************************************************************* *
+ * "make bench" runs this in bench/ on the programs there, none of which
+ * read input:
+ *      arith.a     a linear congruential sequence: mul, add and mod
+ *      recurse.a   chains of 5000 nested calls and returns
+ *      tailcall.a  a state machine passing control on with tail calls
+ *      memory.a    readw/storew sweeps over a 64KB array
+ *      output.a    saystr, saynum and saychar, a line at a time
+ *      mapscan.a   counting the walls in a map read with .mapdata
+ *
+ * Each program is assembled, then run several times with its output going
+ * to /dev/null; the best run is reported as nanoseconds per bytecode
+ * instruction (from vm_get_stats). The assembler's throughput is measured
+ * on a large generated source. With --baseline the results are compared
+ * with those a run with --save wrote earlier.
+ */
+#define BENCH_DEFAULT_RUNS  5
+#define BENCH_STACK_SIZE    (1024 * 1024)
+#define BENCH_MAX_RESULTS   64
+#define ASM_SOURCE          "asmbench.a"
+#define ASM_FUNCTIONS       2000
+
+struct result {
+    char name[64];
+    double value;
+};
+
+static struct result baseline[BENCH_MAX_RESULTS];
+static unsigned baseline_count;
+static struct result results[BENCH_MAX_RESULTS];
+static unsigned result_count;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void load_baseline(const char *filename) {
+    FILE *in = fopen(filename, "rt");
+    if (!in) {
+        return;
+    }
+    while (baseline_count < BENCH_MAX_RESULTS
+            && fscanf(in, "%63s %lf", baseline[baseline_count].name,
+                      &baseline[baseline_count].value) == 2) {
+        ++baseline_count;
+    }
+    fclose(in);
+}
+
+static int save_results(const char *filename) {
+    FILE *out = fopen(filename, "wt");
+    if (!out) {
+        return 0;
+    }
+    for (unsigned i = 0; i < result_count; ++i) {
+        fprintf(out, "%s %g\n", results[i].name, results[i].value);
+    }
+    return fclose(out) == 0;
+}
+
+/* Records a result and prints how it compares with the baseline; for
+ * ns/instruction lower is better, for lines/second higher is. */
+static void report(const char *name, double value, int higher_is_better) {
+    if (result_count < BENCH_MAX_RESULTS) {
+        snprintf(results[result_count].name, sizeof(results[0].name), "%s", name);
+        results[result_count].value = value;
+        ++result_count;
+    }
+    for (unsigned i = 0; i < baseline_count; ++i) {
+        if (strcmp(baseline[i].name, name) == 0 && baseline[i].value > 0) {
+            double change = (value - baseline[i].value) / baseline[i].value * 100.0;
+            int better = higher_is_better ? change > 0 : change < 0;
+            printf("  (baseline %g, %+.1f%%%s)", baseline[i].value, change,
+                   change == 0.0 ? "" : better ? " better" : " worse");
+            break;
+        }
+    }
+    printf("\n");
+}
+
+/* Returns the best time of runs runs of the assembler on source, or a
+ * negative number if it failed. */
+static double assemble(const char *assembler, const char *source,
+                       const char *output, unsigned runs) {
+    char command[1024];
+    snprintf(command, sizeof(command), "%s %s %s > /dev/null", assembler, source, output);
+    double best = -1;
+    for (unsigned i = 0; i < runs; ++i) {
+        double started = now();
+        if (system(command) != 0) {
+            return -1;
+        }
+        double elapsed = now() - started;
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+static int bench_program(const char *source, const char *assembler,
+                         unsigned runs, int use_jit, int devnull) {
+    char name[64], image[128];
+    const char *dot = strrchr(source, '.');
+    snprintf(name, sizeof(name), "%.*s", dot ? (int)(dot - source) : (int)strlen(source), source);
+    snprintf(image, sizeof(image), "%s.bc", name);
+    if (assemble(assembler, source, image, 1) < 0) {
+        fprintf(stderr, "%s: could not assemble.\n", source);
+        return 0;
+    }
+
+    double best = -1;
+    unsigned long long instructions = 0;
+    for (unsigned i = 0; i < runs; ++i) {
+        struct vmstate vm;
+        if (!vm_init_file(&vm, image)) {
+            fprintf(stderr, "%s: could not open vm image.\n", image);
+            return 0;
+        }
+        int start_addr = vm_get_export(&vm, "start");
+        if (start_addr < 0 || !vm_set_stack_size(&vm, BENCH_STACK_SIZE)) {
+            fprintf(stderr, "%s: no start address, or no room for a stack.\n", image);
+            vm_free(&vm);
+            return 0;
+        }
+        vm_set_output_fd(&vm, devnull);
+
+        double started = now();
+        int result = use_jit ? vm_run_jit(&vm, start_addr) : vm_run(&vm, start_addr);
+        double elapsed = now() - started;
+        instructions = vm_get_stats(&vm).instructions;
+        vm_free(&vm);
+        if (!result) {
+            fprintf(stderr, "%s: vm error occured.\n", image);
+            return 0;
+        }
+        if (best < 0 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+
+    double ns = instructions ? best * 1e9 / instructions : 0;
+    printf("%-10s %12llu insns %9.1fms %7.3f ns/insn", name, instructions,
+           best * 1000, ns);
+    report(name, ns, 0);
+    return 1;
+}
+
+/* A source of ASM_FUNCTIONS small functions, each referring to the next
+ * one ahead of its definition, so label patching gets exercised too. */
+static int write_asm_source(unsigned *lines, long *bytes) {
+    FILE *out = fopen(ASM_SOURCE, "wt");
+    if (!out) {
+        return 0;
+    }
+    fprintf(out, ".export start\n");
+    *lines = 1;
+    for (unsigned i = 0; i < ASM_FUNCTIONS; ++i) {
+        fprintf(out, "data%u:\n    .word %u\n    .string \"function %u\"\n"
+                     "function%u:\n    pushw data%u\n    readw\n    pushb 3\n"
+                     "    mul\n    pushw function%u\n    call\n    add\n    ret\n",
+                i, i, i, i, i, i + 1);
+        *lines += 12;
+    }
+    fprintf(out, "function%u:\n    pushb 0\n    ret\nstart:\n    exit\n", ASM_FUNCTIONS);
+    *lines += 5;
+    *bytes = ftell(out);
+    return fclose(out) == 0;
+}
+
+static int bench_assembler(const char *assembler, unsigned runs) {
+    unsigned lines;
+    long bytes;
+    if (!write_asm_source(&lines, &bytes)) {
+        fprintf(stderr, "could not write %s.\n", ASM_SOURCE);
+        return 0;
+    }
+    double best = assemble(assembler, ASM_SOURCE, "asmbench.bc", runs);
+    remove(ASM_SOURCE);
+    remove("asmbench.bc");
+    if (best < 0) {
+        fprintf(stderr, "%s: could not assemble.\n", ASM_SOURCE);
+        return 0;
+    }
+    printf("%-10s %12u lines %9.1fms %7.0f lines/ms (%.1f MB/s)", "assembler",
+           lines, best * 1000, lines / best / 1000, bytes / best / 1e6);
+    report("assembler", lines / best, 1);
+    return 1;
+}
+
+int main(int argc, char *argv[]) {
+    const char *assembler = "../assemble";
+    const char *save = NULL;
+    unsigned runs = BENCH_DEFAULT_RUNS;
+    int use_jit = 0;
+    int first_program = argc;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--assembler") == 0 && i + 1 < argc) {
+            assembler = argv[++i];
+        } else if (strcmp(argv[i], "--runs") == 0 && i + 1 < argc) {
+            runs = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            use_jit = 1;
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            load_baseline(argv[++i]);
+        } else if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+            save = argv[++i];
+        } else if (argv[i][0] != '-') {
+            first_program = i;
+            break;
+        } else {
+            fprintf(stderr, "usage: %s [--assembler path] [--runs count] [--jit] "
+                    "[--baseline file] [--save file] program.a...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (runs == 0) {
+        runs = 1;
+    }
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull < 0) {
+        fprintf(stderr, "could not open /dev/null.\n");
+        return 1;
+    }
+
+    int ok = 1;
+    for (int i = first_program; i < argc; ++i) {
+        ok = bench_program(argv[i], assembler, runs, use_jit, devnull) && ok;
+    }
+    ok = bench_assembler(assembler, runs) && ok;
+    close(devnull);
+
+    if (save) {
+        if (!save_results(save)) {
+            fprintf(stderr, "could not write %s.\n", save);
+            return 1;
+        }
+        printf("saved as the baseline in %s\n", save);
+    }
+    return ok ? 0 : 1;
+}
@@ -37,6 +37,38 @@ enum opcode {
     op_jz,
     op_jnz,
 
+    /* one byte operand: the local or argument number */
+    op_getlocal,
+    op_setlocal,
+    op_getarg,
+    op_setarg,
+
+    /* always followed by a ret, which a tail call the VM cannot prove
+     * safe is made as a call returning to */
+    op_tailcall,
+
+    /* a signed offset from the branch's own address, one or two bytes */
+    op_jump8,
+    op_jump16,
+    op_jz8,
+    op_jz16,
+    op_jnz8,
+    op_jnz16,
+
+    /* the constant is in the opcode: 0, 1, -1 and '\n' */
+    op_push0,
+    op_push1,
+    op_pushm1,
+    op_pushnl,
+    /* a signed LEB128 constant, one to five bytes; the fifth always ends it */
+    op_pushv,
+
+    /* bulk memory, with the operands pushed in C's order */
+    op_memcpy,      /* dest src size; overlapping ranges are fine */
+    op_memset,      /* dest byte size */
+    op_memcmp,      /* a b size -> -1, 0 or 1 */
+    op_memchr,      /* address byte size -> address found, or -1 */
+
     op_bad = -1
 };
 
@@ -0,0 +1,110 @@
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "toyvm.h"
+
+/* ************************************************************************* *
+ * CHECKPOINT ROUND TRIP                                                     *
+ * ************************************************************************* *
+ * tests/run.sh runs this on input.a. The image is given its input a line
+ * at a time: it is snapshotted at the first gets and checkpointed at every
+ * gets after that, then finished. The snapshot is then restored twice, once
+ * with the chain of checkpoints applied and once with the chain merged by
+ * vm_compact_checkpoints, and both run to the end with no more input. Each
+ * prints the same totals as the first run only if the checkpoints brought
+ * back its memory and stack.
+ *
+ *      checkpoint image input directory
+ *
+ * The snapshot and checkpoints are left in directory.
+ */
+#define CHECKPOINT_MAX      16
+#define CHECKPOINT_PATH     512
+
+static char snapshot[CHECKPOINT_PATH];
+static char chain[CHECKPOINT_MAX][CHECKPOINT_PATH];
+static const char *chain_names[CHECKPOINT_MAX];
+static char compacted[CHECKPOINT_PATH];
+
+static int finish(const char *const *checkpoints, unsigned count) {
+    struct vmstate vm;
+    if (!vm_restore(&vm, snapshot)) {
+        fprintf(stderr, "could not restore snapshot %s.\n", snapshot);
+        return 0;
+    }
+    int ok = 1;
+    for (unsigned i = 0; ok && i < count; ++i) {
+        ok = vm_apply_checkpoint(&vm, checkpoints[i]);
+        if (!ok) {
+            fprintf(stderr, "could not apply checkpoint %s.\n", checkpoints[i]);
+        }
+    }
+    /* the queued input is not saved; this one has none left */
+    vm_close_input(&vm);
+    if (ok && vm_run_for(&vm, ULONG_MAX) != vm_status_exited) {
+        fprintf(stderr, "vm error occured.\n");
+        ok = 0;
+    }
+    vm_free(&vm);
+    return ok;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "usage: %s image input directory\n", argv[0]);
+        return 1;
+    }
+    FILE *input = fopen(argv[2], "rt");
+    if (!input) {
+        fprintf(stderr, "could not open %s.\n", argv[2]);
+        return 1;
+    }
+    snprintf(snapshot, sizeof(snapshot), "%s/snapshot", argv[3]);
+    snprintf(compacted, sizeof(compacted), "%s/compacted", argv[3]);
+
+    struct vmstate vm;
+    if (!vm_init_file(&vm, argv[1])) {
+        fprintf(stderr, "could not open vm image.\n");
+        fclose(input);
+        return 1;
+    }
+    int start_addr = vm_get_export(&vm, "start");
+    vm_provide_input(&vm, "", 0);
+    int ok = start_addr >= 0 && vm_start(&vm, start_addr)
+          && vm_run_for(&vm, ULONG_MAX) == vm_status_waiting
+          && vm_snapshot(&vm, snapshot);
+
+    char line[256];
+    unsigned count = 0;
+    while (ok && fgets(line, sizeof(line), input)) {
+        if (count == CHECKPOINT_MAX) {
+            ok = 0;
+            break;
+        }
+        vm_provide_input(&vm, line, strlen(line));
+        snprintf(chain[count], sizeof(chain[count]), "%s/checkpoint.%u",
+                 argv[3], count);
+        chain_names[count] = chain[count];
+        ok = vm_run_for(&vm, ULONG_MAX) == vm_status_waiting
+          && vm_checkpoint(&vm, chain[count]);
+        ++count;
+    }
+    fclose(input);
+    vm_close_input(&vm);
+    ok = ok && vm_run_for(&vm, ULONG_MAX) == vm_status_exited;
+    vm_free(&vm);
+    if (!ok) {
+        fprintf(stderr, "vm error occured.\n");
+        return 1;
+    }
+
+    if (!vm_compact_checkpoints(compacted, chain_names, count)) {
+        fprintf(stderr, "could not compact checkpoints into %s.\n", compacted);
+        return 1;
+    }
+    const char *compacted_name = compacted;
+    ok = finish(chain_names, count);
+    ok = finish(&compacted_name, 1) && ok;
+    return !ok;
+}
@@ -0,0 +1,82 @@
+#!/bin/sh
+# Runs every program in tests/ on each VM given and compares what it prints
+# with its .out file. A program reads its .in file if it has one, and
+# nothing otherwise, and must exit with the status in its .status file if it
+# has one, and 0 otherwise. "make test" runs it as
+#
+#     tests/run.sh ./assemble ./toyvm "./toyvm --jit" ./toyvm-switch ...
+#
+# input.a is also run through the scheduler (--instances), saved with
+# --snapshot and finished with --restore, and put through a chain of
+# checkpoints by tests/checkpoint and "toyvm --compact".
+
+assembler=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+shift
+tests=$(cd "$(dirname "$0")" && pwd)
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+passed=0
+failed=0
+
+# check name expected-file actual-file
+check() {
+    if cmp -s "$2" "$3"; then
+        passed=$((passed + 1))
+    else
+        echo "FAIL: $1"
+        diff "$2" "$3" | head -20
+        failed=$((failed + 1))
+    fi
+}
+
+# status name expected actual
+status() {
+    if [ "$2" -ne "$3" ]; then
+        echo "FAIL: $1 exited with $3, not $2"
+        failed=$((failed + 1))
+    fi
+}
+
+for source in "$tests"/*.a; do
+    name=$(basename "$source" .a)
+    # the assembler writes labels.txt where it runs
+    (cd "$work" && "$assembler" "$source" "$name.bc" > /dev/null) || {
+        echo "FAIL: could not assemble $source"
+        failed=$((failed + 1))
+        continue
+    }
+    input=/dev/null
+    [ -f "$tests/$name.in" ] && input=$tests/$name.in
+    expected=0
+    [ -f "$tests/$name.status" ] && expected=$(cat "$tests/$name.status")
+    for vm in "$@"; do
+        $vm "$work/$name.bc" < "$input" > "$work/out" 2> "$work/err"
+        status "$name on $vm" "$expected" $?
+        check "$name on $vm" "$tests/$name.out" "$work/out"
+    done
+done
+
+vm=$1
+sort "$tests/input.out" "$tests/input.out" "$tests/input.out" "$tests/input.out" \
+    > "$work/expected"
+$vm --instances 4 --workers 3 "$work/input.bc" < "$tests/input.in" 2> "$work/err" \
+    | sort > "$work/out"
+check "input through the scheduler" "$work/expected" "$work/out"
+
+$vm --snapshot "$work/input.snapshot" "$work/input.bc" < /dev/null > "$work/out"
+status "--snapshot" 0 $?
+$vm --restore "$work/input.snapshot" < "$tests/input.in" >> "$work/out"
+status "--restore" 0 $?
+check "input snapshot and restore" "$tests/input.out" "$work/out"
+
+mkdir "$work/checkpoints"
+"$tests/checkpoint" "$work/input.bc" "$tests/input.in" "$work/checkpoints" > "$work/out"
+status "checkpoint" 0 $?
+check "input checkpoints" "$tests/checkpoint.out" "$work/out"
+$vm --compact "$work/compacted" "$work"/checkpoints/checkpoint.* 2> "$work/err"
+status "--compact" 0 $?
+$vm --compact "$work/compacted" "$work/checkpoints/missing" 2> "$work/err"
+status "--compact with a missing checkpoint" 1 $?
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]
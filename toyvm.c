@@ -1,52 +1,262 @@
+#define _POSIX_C_SOURCE 199309L
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "toyvm.h"
 
 
+static unsigned failed_instances;
 
-int main() {
-    struct vmstate vm;
+static void instance_done(void *data, struct vm_task *task,
+                          struct vmstate *vm, enum vm_status status) {
+    if (status != vm_status_exited) {
+        __atomic_add_fetch(&failed_instances, 1, __ATOMIC_RELAXED);
+    }
+    vm_free(vm);
+    free(vm);
+}
 
-    FILE *in = fopen("output.bc", "rb");
-    if (!in) {
+/* Runs copies of the image through the scheduler, each reading all of
+ * stdin as its input, and reports how many finished per second. The copies
+ * share one vm_image, so only the pages each one changes cost memory. */
+static int run_instances(const char *filename, unsigned long stack_size,
+                         unsigned instances, unsigned workers) {
+    struct vm_image *image = vm_image_load(filename);
+    if (!image) {
         fprintf(stderr, "could not open vm image.\n");
         return 1;
     }
-    fseek(in, 0, SEEK_END);
-    unsigned filesize = ftell(in);
-    rewind(in);
 
-    unsigned char *memory = malloc(filesize);
-    if (!memory) {
-        fclose(in);
-        fprintf(stderr, "memory allocation failed.\n");
+    char *input = NULL;
+    size_t input_length = 0, capacity = 0, got;
+    do {
+        if (input_length == capacity) {
+            capacity = capacity ? capacity * 2 : 4096;
+            char *new_input = realloc(input, capacity);
+            if (!new_input) break;
+            input = new_input;
+        }
+        got = fread(input + input_length, 1, capacity - input_length, stdin);
+        input_length += got;
+    } while (got > 0);
+
+    struct timespec started, finished;
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    struct vm_scheduler *sched = vm_sched_create(workers, 0, instance_done, NULL);
+    if (!sched) {
+        fprintf(stderr, "could not start the scheduler.\n");
+        free(input);
+        vm_image_free(image);
         return 1;
     }
+    for (unsigned i = 0; i < instances; ++i) {
+        struct vmstate *vm = malloc(sizeof(struct vmstate));
+        if (!vm || !vm_init_image(vm, image)) {
+            fprintf(stderr, "could not open vm image.\n");
+            free(vm);
+            __atomic_add_fetch(&failed_instances, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        struct vm_task *task = NULL;
+        if (!stack_size || vm_set_stack_size(vm, stack_size)) {
+            task = vm_sched_add(sched, vm, vm_get_export(vm, "start"));
+        }
+        if (!task) {
+            vm_free(vm);
+            free(vm);
+            __atomic_add_fetch(&failed_instances, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        vm_sched_input(sched, task, input, input_length);
+        vm_sched_close_input(sched, task);
+    }
+    vm_sched_wait(sched);
+    workers = vm_sched_worker_count(sched);
+    vm_sched_free(sched);
+    clock_gettime(CLOCK_MONOTONIC, &finished);
+    free(input);
+    vm_image_free(image);
+
+    double seconds = finished.tv_sec - started.tv_sec
+                   + (finished.tv_nsec - started.tv_nsec) / 1e9;
+    fprintf(stderr, "%u instances on %u workers in %.3fs: %.0f scripts/sec, %u failed\n",
+            instances, workers, seconds, instances / seconds, failed_instances);
+    return failed_instances != 0;
+}
 
-    fread(memory, filesize, 1, in);
-    fclose(in);
+/* --sample: folded stacks for flamegraph.pl, with the functions named from
+ * the labels.txt the assembler left in the current directory. */
+static const char *sample_file;
 
-    vm_init_memory(&vm, filesize, memory);
+static void write_samples(void) {
+    vm_sample_stop();
+    if (!vm_sample_write(sample_file, "labels.txt")) {
+        fprintf(stderr, "could not write samples to %s.\n", sample_file);
+    }
+}
+
+/* Runs the image's start up to the first gets that has nothing to read,
+ * and saves it there for --restore. */
+static int save_snapshot(struct vmstate *vm, int start_addr, const char *filename) {
+    enum vm_status status = vm_status_error;
+    vm_provide_input(vm, "", 0);
+    if (vm_start(vm, start_addr)) {
+        status = vm_run_for(vm, ULONG_MAX);
+    }
+    if (status != vm_status_waiting) {
+        fprintf(stderr, "vm never waited for input; no snapshot written.\n");
+        return 0;
+    }
+    if (!vm_snapshot(vm, filename)) {
+        fprintf(stderr, "could not write snapshot %s.\n", filename);
+        return 0;
+    }
+    return 1;
+}
+
+/* After an error, the calls that were in progress, innermost first. */
+#define BACKTRACE_MAX   16
+
+static void print_backtrace(struct vmstate *vm) {
+    unsigned shown = 0, skipped = 0;
+    for (const struct vm_frame *frame = vm_call_stack(vm); frame; frame = frame->prev) {
+        if (shown == BACKTRACE_MAX && frame->prev) {
+            ++skipped;
+            continue;
+        }
+        if (skipped) {
+            fprintf(stderr, "  ... %u more\n", skipped);
+            skipped = 0;
+        }
+        if (frame->prev) {
+            fprintf(stderr, "  in 0x%08X, called from 0x%08X\n",
+                    frame->func_addr, frame->ret_addr - 1);
+        } else {
+            fprintf(stderr, "  in 0x%08X\n", frame->func_addr);
+        }
+        ++shown;
+    }
+}
+
+static void print_stats(struct vmstate *vm) {
+    struct vm_stats stats = vm_get_stats(vm);
+    fprintf(stderr, "%llu instructions, %llu calls, %llu returns, "
+            "%llu bytes read, %llu bytes written, %llu I/O operations, "
+            "stack depth %u\n", stats.instructions, stats.calls, stats.returns,
+            stats.bytes_read, stats.bytes_written, stats.io_ops,
+            stats.max_stack_depth);
+}
+
+int main(int argc, char *argv[]) {
+    struct vmstate vm;
+    int use_jit = 0, show_stats = 0;
+    unsigned long stack_size = 0;
+    unsigned long instances = 0, workers = 0;
+    const char *image = "output.bc";
+    const char *snapshot = NULL, *restore = NULL;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--jit") == 0) {
+            use_jit = 1;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            show_stats = 1;
+        } else if (strcmp(argv[i], "--stack-size") == 0 && i + 1 < argc) {
+            stack_size = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instances = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = strtoul(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc) {
+            snapshot = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore = argv[++i];
+        } else if (strcmp(argv[i], "--sample") == 0 && i + 1 < argc) {
+            sample_file = argv[++i];
+        } else if (strcmp(argv[i], "--compact") == 0 && i + 2 < argc) {
+            /* the rest of the arguments are the chain, oldest first */
+            if (!vm_compact_checkpoints(argv[i + 1], (const char *const*)&argv[i + 2],
+                                        argc - i - 2)) {
+                fprintf(stderr, "could not compact checkpoints into %s.\n", argv[i + 1]);
+                return 1;
+            }
+            return 0;
+        } else if (argv[i][0] != '-') {
+            image = argv[i];
+        } else {
+            fprintf(stderr, "usage: %s [--jit] [--stats] [--stack-size bytes] [--sample file] "
+                    "[--instances count [--workers count]] "
+                    "[--snapshot file | --restore file] [image]\n"
+                    "       %s --compact output checkpoint...\n", argv[0], argv[0]);
+            return 1;
+        }
+    }
+    if (sample_file) {
+        if (!vm_sample_start(0)) {
+            fprintf(stderr, "could not start the sampling profiler.\n");
+            return 1;
+        }
+        atexit(write_samples);
+    }
+    if (instances > 0) {
+        return run_instances(image, stack_size, instances, workers);
+    }
+    if (restore) {
+        /* the snapshot already has its stack and the rest of setup done */
+        if (!vm_restore(&vm, restore)) {
+            fprintf(stderr, "could not restore snapshot %s.\n", restore);
+            return 1;
+        }
+        int result = vm_run_for(&vm, ULONG_MAX) == vm_status_exited;
+        if (!result) {
+            fprintf(stderr, "vm error occured.\n");
+            print_backtrace(&vm);
+        }
+        if (show_stats) {
+            print_stats(&vm);
+        }
+        vm_free(&vm);
+        return !result;
+    }
+
+    if (!vm_init_file(&vm, image)) {
+        fprintf(stderr, "could not open vm image.\n");
+        return 1;
+    }
+    if (stack_size && !vm_set_stack_size(&vm, stack_size)) {
+        vm_free(&vm);
+        fprintf(stderr, "could not allocate a stack of %lu bytes.\n", stack_size);
+        return 1;
+    }
 
     int map_addr = vm_get_export(&vm, "mapdata");
-    int w = vm_read_short(&vm, map_addr);
-    int h = vm_read_short(&vm, map_addr + 2);
-    printf("Map Size: %dx%d (%d bytes)\nMap Data Start: 0x%X\n\n", w, h, w*h, map_addr + 4);
+    if (map_addr >= 0) {
+        int w = vm_read_short(&vm, map_addr);
+        int h = vm_read_short(&vm, map_addr + 2);
+        printf("Map Size: %dx%d (%d bytes)\nMap Data Start: 0x%X\n\n", w, h, w*h, map_addr + 4);
+    }
 
     int start_addr = vm_get_export(&vm, "start");
     int run_failed = 0;
     if (start_addr < 0) {
         fprintf(stderr, "Could not find program start address.\n");
         run_failed = 1;
+    } else if (snapshot) {
+        run_failed = !save_snapshot(&vm, start_addr, snapshot);
     } else {
-        if (!vm_run(&vm, start_addr)) {
+        int result = use_jit ? vm_run_jit(&vm, start_addr)
+                             : vm_run(&vm, start_addr);
+        if (!result) {
             fprintf(stderr, "vm error occured.\n");
+            print_backtrace(&vm);
             run_failed = 1;
         }
     }
+    if (show_stats) {
+        print_stats(&vm);
+    }
     vm_free(&vm);
-
-    free(memory);
-    return !run_failed;
+    return run_failed;
 }
@@ -1,30 +1,172 @@
 #ifndef TOYVM_H_4356346157
 #define TOYVM_H_4356346157
 
+/* One call in progress on a VM's return stack; see vm_frames.c. */
 struct vm_frame {
     int func_addr;
-    int ret_addr;
+    int ret_addr;           /* -1 in the outermost frame */
+    int base;               /* its frame_ptr, in entries from vm->stack */
+    int ret_base;           /* where ret cuts the stack back to: base, or
+                               below it after a tail call */
 
-    struct vm_frame *prev;
+    struct vm_frame *prev;  /* the caller's frame, NULL in the outermost */
     struct vm_frame *next;
 };
 
+struct vm_insn;
+struct vm_jit;
+struct vm_function;
+struct vm_guard;
+struct vm_export_index;
+struct vm_output;
+struct vm_input;
+struct vm_image;
+struct vm_profile;
+struct vm_stats;
+struct vm_frame_chunk;
+
 struct vmstate {
     int *stack;
     unsigned stack_size;
     int *stack_ptr;
     int *frame_ptr;
+    struct vm_frame *call_frame;    /* innermost call */
+    struct vm_frame_chunk *frame_chunks;
     unsigned char *ip;
+    unsigned pc;            /* last instruction that may fault */
 
     unsigned char *fixed_memory;
     unsigned memory_size;
+
+    struct vm_insn *code;
+    unsigned char *code_marks;
+    struct vm_jit *jit;
+    struct vm_function *functions;
+    int code_verified;
+    struct vm_guard *guard;
+    struct vm_export_index *exports;
+    struct vm_output *output;
+    struct vm_input *input;
+    int state_mapped;       /* code, code_marks and functions come from a vm_image */
+    unsigned char *dirty;   /* blocks written since the last checkpoint */
+    struct vm_profile *profile; /* make PROFILE=1 only; see vm_profile.c */
+    struct vm_stats *stats;
+
+    /* where vm_run_for picks up again after it was paused or stopped */
+    unsigned resume_pc;
+    int resumable;
+    int resume_verified;
+    long budget;
+    int stop_requested;     /* set by vm_stop, possibly from another thread */
+};
+
+enum vm_status {
+    vm_status_error,        /* 0, as vm_run has always returned */
+    vm_status_exited,
+    vm_status_paused,       /* used up its budget */
+    vm_status_stopped,      /* vm_stop was called */
+    vm_status_waiting       /* gets found no line in vm_provide_input's queue */
 };
 
 int vm_init_memory(struct vmstate *vm, unsigned memory_size, unsigned char *memory);
+int vm_init_file(struct vmstate *vm, const char *filename);
+
+/* An image loaded once for any number of instances, which share its pages
+ * copy-on-write; see vm_image.c. */
+struct vm_image* vm_image_create(unsigned memory_size, const unsigned char *memory);
+struct vm_image* vm_image_load(const char *filename);
+void vm_image_free(struct vm_image *image);
+int vm_init_image(struct vmstate *vm, const struct vm_image *image);
+
+int vm_set_stack_size(struct vmstate *vm, unsigned stack_size);
 int vm_get_export(struct vmstate *vm, const char *name);
+int vm_find_export(struct vmstate *vm, const char *name);
+int vm_export_address(struct vmstate *vm, int handle);
+/* vm_run returns 1 if the program exited and 0 otherwise, including when
+ * vm_stop interrupts it or gets waits on vm_provide_input's queue. */
 int vm_run(struct vmstate *vm, unsigned start_address);
+
+/* vm_start sets the VM up to run from start_address, and each vm_run_for
+ * then runs it for about budget instructions. A paused or stopped VM
+ * continues where it left off on the next vm_run_for. vm_stop may be
+ * called from any thread; the VM notices at its next backward branch or
+ * call. */
+int vm_start(struct vmstate *vm, unsigned start_address);
+enum vm_status vm_run_for(struct vmstate *vm, unsigned long budget);
+void vm_stop(struct vmstate *vm);
+
+/* vm_snapshot saves a paused, stopped or waiting VM's memory, stack and
+ * resume point; vm_restore maps them into a new VM that vm_run_for then
+ * continues. Output settings and queued input are not saved. */
+int vm_snapshot(struct vmstate *vm, const char *filename);
+int vm_restore(struct vmstate *vm, const char *filename);
+
+/* vm_checkpoint saves only the memory written since the last snapshot or
+ * checkpoint, along with the stack and resume point. Applying each
+ * checkpoint of a chain in turn to a VM set up as the chain started brings
+ * it up to date; vm_compact_checkpoints merges a chain into one file. */
+int vm_checkpoint(struct vmstate *vm, const char *filename);
+int vm_apply_checkpoint(struct vmstate *vm, const char *filename);
+int vm_compact_checkpoints(const char *filename, const char *const *chain,
+                           unsigned count);
+
+int vm_run_jit(struct vmstate *vm, unsigned start_address);
 int vm_free(struct vmstate *vm);
 
+/* The innermost call in progress, for backtraces: each frame's prev is its
+ * caller, back to the outermost frame for the address vm_start ran.
+ * Valid until the VM runs again. */
+const struct vm_frame* vm_call_stack(struct vmstate *vm);
+
+/* Output from saynum, saychar and saystr is buffered and goes to stdout
+ * unless sent to another fd or to a callback; vm_run flushes it before
+ * returning. */
+typedef void (*vm_output_callback)(void *data, const char *text, unsigned length);
+void vm_set_output_fd(struct vmstate *vm, int fd);
+void vm_set_output_callback(struct vmstate *vm, vm_output_callback callback, void *data);
+void vm_flush_output(struct vmstate *vm);
+
+/* Once the host provides input, gets reads it from a queue instead of
+ * stdin, and vm_run_for returns vm_status_waiting when there is no whole
+ * line to read yet. */
+void vm_provide_input(struct vmstate *vm, const char *text, unsigned length);
+void vm_close_input(struct vmstate *vm);
+
+/* Counters every VM keeps as it runs, safe to read from any thread; see
+ * vm_stats.c. */
+struct vm_stats {
+    unsigned long long instructions;    /* bytecode instructions executed */
+    unsigned long long calls;
+    unsigned long long returns;
+    unsigned long long bytes_read;      /* by the reads and bulk opcodes */
+    unsigned long long bytes_written;   /* by the stores, gets and bulk opcodes */
+    unsigned long long io_ops;          /* gets, saynum, saychar and saystr */
+    unsigned max_stack_depth;           /* in entries */
+};
+struct vm_stats vm_get_stats(struct vmstate *vm);
+
+/* A sampling profiler for every VM in the process, writing folded stacks
+ * named from the assembler's labels.txt; see vm_sample.c. */
+int vm_sample_start(unsigned hz);
+void vm_sample_stop(void);
+int vm_sample_write(const char *filename, const char *labels_file);
+
+/* Runs many VMs at once on a pool of worker threads; see vm_sched.c. */
+struct vm_scheduler;
+struct vm_task;
+typedef void (*vm_task_done)(void *data, struct vm_task *task,
+                             struct vmstate *vm, enum vm_status status);
+struct vm_scheduler* vm_sched_create(unsigned workers, unsigned long slice,
+                                     vm_task_done done, void *data);
+struct vm_task* vm_sched_add(struct vm_scheduler *sched, struct vmstate *vm,
+                             unsigned start_address);
+void vm_sched_input(struct vm_scheduler *sched, struct vm_task *task,
+                    const char *text, unsigned length);
+void vm_sched_close_input(struct vm_scheduler *sched, struct vm_task *task);
+unsigned vm_sched_wait(struct vm_scheduler *sched);
+unsigned vm_sched_worker_count(struct vm_scheduler *sched);
+void vm_sched_free(struct vm_scheduler *sched);
+
 int vm_read_byte(struct vmstate *vm, unsigned address);
 int vm_read_short(struct vmstate *vm, unsigned address);
 int vm_read_word(struct vmstate *vm, unsigned address);
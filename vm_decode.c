@@ -0,0 +1,312 @@
+#include <stdlib.h>
+
+#include "toyvm.h"
+#include "opcode.h"
+#include "vm_internal.h"
+
+static const unsigned char simple_ops[] = {
+    [op_exit]       = xop_exit,
+    [op_stkdup]     = xop_stkdup,
+    [op_readb]      = xop_readb,
+    [op_reads]      = xop_reads,
+    [op_readw]      = xop_readw,
+    [op_storeb]     = xop_storeb,
+    [op_stores]     = xop_stores,
+    [op_storew]     = xop_storew,
+    [op_add]        = xop_add,
+    [op_sub]        = xop_sub,
+    [op_mul]        = xop_mul,
+    [op_div]        = xop_div,
+    [op_mod]        = xop_mod,
+    [op_inc]        = xop_inc,
+    [op_dec]        = xop_dec,
+    [op_gets]       = xop_gets,
+    [op_saynum]     = xop_saynum,
+    [op_saychar]    = xop_saychar,
+    [op_saystr]     = xop_saystr,
+    [op_memcpy]     = xop_memcpy,
+    [op_memset]     = xop_memset,
+    [op_memcmp]     = xop_memcmp,
+    [op_memchr]     = xop_memchr,
+    [op_call]       = xop_call,
+    [op_ret]        = xop_ret,
+    [op_tailcall]   = xop_tailcall,
+    [op_jump]       = xop_jump,
+    [op_jumprel]    = xop_jumprel,
+    [op_jz]         = xop_jz,
+    [op_jnz]        = xop_jnz,
+};
+
+
+int vm_decode_init(struct vmstate *vm) {
+    vm->code = calloc(vm->memory_size + 1, sizeof(struct vm_insn));
+    vm->code_marks = calloc(vm->memory_size + sizeof(uint32_t), 1);
+    if (!vm->code || !vm->code_marks) {
+        vm_decode_free(vm);
+        return 0;
+    }
+    vm->code[vm->memory_size].xop = xop_outside;
+    return 1;
+}
+
+void vm_decode_free(struct vmstate *vm) {
+    free(vm->code);
+    free(vm->code_marks);
+    vm->code = NULL;
+    vm->code_marks = NULL;
+}
+
+/* Decodes a getlocal, setlocal, getarg or setarg at address, storing the
+ * entry it names as an offset from frame_ptr in *slot. Returns the length
+ * of the instruction, or 0 if there is no complete one there. */
+static int decode_frame(struct vmstate *vm, unsigned address, int *slot) {
+    const unsigned char *pc = &vm->fixed_memory[address];
+
+    if (*pc != op_getlocal && *pc != op_setlocal
+            && *pc != op_getarg && *pc != op_setarg) {
+        return 0;
+    }
+    if (2 > vm->memory_size - address) {
+        return 0;
+    }
+    *slot = *pc == op_getlocal || *pc == op_setlocal ? pc[1] : VM_FRAME_ARG(pc[1]);
+    return 2;
+}
+
+/* ************************************************************************* *
+ * SUPERINSTRUCTIONS                                                         *
+ * ************************************************************************* *
+ * A constant push followed by one of these opcodes is decoded as a single
+ * entry taking the pushed value as its operand, saving the stack round trip
+ * and one dispatch. The set was chosen from toyvm-opcount runs, which build
+ * without fusion so they see the opcodes actually in the bytecode.
+ */
+static const unsigned char push_fusions[] = {
+    [op_readb]      = xop_readb_imm,
+    [op_reads]      = xop_reads_imm,
+    [op_readw]      = xop_readw_imm,
+    [op_storeb]     = xop_storeb_imm,
+    [op_stores]     = xop_stores_imm,
+    [op_storew]     = xop_storew_imm,
+    [op_add]        = xop_add_imm,
+    [op_sub]        = xop_sub_imm,
+    [op_saychar]    = xop_saychar_imm,
+    [op_saystr]     = xop_saystr_imm,
+    [op_call]       = xop_call_imm,
+    [op_tailcall]   = xop_tailcall_imm,
+    [op_jump]       = xop_jump_imm,
+    [op_jz]         = xop_jz_imm,
+    [op_jnz]        = xop_jnz_imm,
+};
+
+/* Tries to fuse the instruction following a constant push into insn. */
+static void fuse_push(struct vmstate *vm, struct vm_insn *insn, unsigned next) {
+#ifdef TOYVM_OPCOUNT
+    return;
+#endif
+    if (next >= vm->memory_size) return;
+
+    unsigned next_op = vm->fixed_memory[next];
+    if (next_op >= sizeof(push_fusions) || push_fusions[next_op] == xop_decode) {
+        return;
+    }
+    if ((next_op == op_call || next_op == op_tailcall || next_op == op_jump
+                || next_op == op_jz || next_op == op_jnz)
+            && (unsigned)insn->operand >= vm->memory_size) {
+        /* leave bad branch targets to be reported when they are taken */
+        return;
+    }
+    insn->xop = push_fusions[next_op];
+    if (next_op == op_tailcall && vm_tail_args(vm, insn->operand) < 0) {
+        /* how many arguments an unproven callee takes is not known, so it
+         * is called, and returns to the ret after the tailcall */
+        insn->xop = xop_call_imm;
+    }
+    ++insn->length;
+}
+
+/* stkdup; push <target>; jnz -- the usual countdown loop tail -- or
+ * stkdup; jnz8 or jnz16, as the assembler writes it now */
+static int fuse_dup_jnz(struct vmstate *vm, struct vm_insn *insn, unsigned address) {
+#ifdef TOYVM_OPCOUNT
+    return 0;
+#endif
+    unsigned value;
+    if (address + 1 >= vm->memory_size) {
+        return 0;
+    }
+    unsigned length = vm_push_length(vm, address + 1, &value);
+    unsigned next = address + 1 + length;
+    if (length > 0 && next < vm->memory_size
+            && vm->fixed_memory[next] == op_jnz && value < vm->memory_size) {
+        insn->xop = xop_dup_jnz_imm;
+        insn->length = length + 2;
+        insn->operand = value;
+        return 1;
+    }
+    unsigned opcode = vm->fixed_memory[address + 1];
+    length = vm_branch_length(vm, address + 1, &value);
+    if (length > 0 && (opcode == op_jnz8 || opcode == op_jnz16)
+            && value < vm->memory_size) {
+        insn->xop = xop_dup_jnz_rel;
+        insn->length = length + 1;
+        insn->operand = value;
+        return 1;
+    }
+    return 0;
+}
+
+/* ************************************************************************* *
+ * BUDGET                                                                    *
+ * ************************************************************************* *
+ * vm_run_for only charges its budget at backward branches and calls, so
+ * straight-line code runs without counting anything. A backward branch is
+ * charged for every instruction from its target up to and including
+ * itself, which is exact for a simple loop; a call is charged one. Code
+ * between those points is bounded by the size of the program, so a run
+ * never goes far past its budget.
+ */
+static unsigned loop_cost(struct vmstate *vm, unsigned target, unsigned end) {
+    unsigned count = 0, value;
+    int slot;
+    while (target <= end && count < 0xFFFF) {
+        int length = vm_push_length(vm, target, &value);
+        if (!length) length = decode_frame(vm, target, &slot);
+        if (!length) length = vm_branch_length(vm, target, &value);
+        target += length > 0 ? length : 1;
+        ++count;
+    }
+    return count;
+}
+
+static unsigned insn_cost(struct vmstate *vm, const struct vm_insn *insn,
+                          unsigned address) {
+    switch (insn->xop) {
+        case xop_jump_imm:
+        case xop_jz_imm:
+        case xop_jnz_imm:
+        case xop_dup_jnz_imm:
+        case xop_jump_rel:
+        case xop_jz_rel:
+        case xop_jnz_rel:
+        case xop_dup_jnz_rel:
+            if ((unsigned)insn->operand <= address) {
+                return loop_cost(vm, insn->operand, address + insn->length - 1);
+            }
+            return 0;
+        case xop_call_imm:
+            return 1;
+        case xop_tailcall_imm:
+            /* charged one by its handler; see struct vm_insn */
+            return vm_tail_args(vm, insn->operand);
+        default:
+            return 0;
+    }
+}
+
+const struct vm_insn* vm_decode_at(struct vmstate *vm, unsigned address) {
+    struct vm_insn *insn = &vm->code[address];
+    unsigned opcode = vm->fixed_memory[address];
+    unsigned value;
+    int slot;
+
+    insn->length = vm_push_length(vm, address, &value);
+    if (insn->length > 0) {
+        insn->xop = xop_push;
+        insn->operand = value;
+        fuse_push(vm, insn, address + insn->length);
+    } else if ((insn->length = decode_frame(vm, address, &slot)) > 0) {
+        insn->xop = opcode == op_getlocal || opcode == op_getarg
+                  ? xop_getframe : xop_setframe;
+        insn->operand = slot;
+    } else if ((insn->length = vm_branch_length(vm, address, &value)) > 0) {
+        insn->xop = opcode == op_jump8 || opcode == op_jump16 ? xop_jump_rel
+                  : opcode == op_jz8 || opcode == op_jz16 ? xop_jz_rel : xop_jnz_rel;
+        insn->operand = value;
+    } else if (opcode == op_pushb || opcode == op_pushs || opcode == op_pushw
+               || opcode == op_pushv
+               || opcode == op_getlocal || opcode == op_setlocal
+               || opcode == op_getarg || opcode == op_setarg
+               || (opcode >= op_jump8 && opcode <= op_jnz16)) {
+        /* the operand runs past the end of memory */
+        insn->xop = xop_outside;
+        insn->length = 0;
+    } else if (opcode == op_stkdup && fuse_dup_jnz(vm, insn, address)) {
+        /* fused */
+    } else if (opcode < sizeof(simple_ops) && simple_ops[opcode] != xop_decode) {
+        insn->xop = simple_ops[opcode];
+        insn->length = 1;
+    } else {
+        insn->xop = xop_bad;
+        insn->length = 1;
+    }
+
+    insn->cost = insn_cost(vm, insn, address);
+    for (unsigned i = 0; i < insn->length; ++i) {
+        vm->code_marks[address + i] |= VM_MARK_CODE;
+    }
+    return insn;
+}
+
+void vm_translate(struct vmstate *vm, unsigned start_address) {
+    unsigned capacity = 64, count = 0;
+    unsigned *work = malloc(capacity * sizeof(unsigned));
+    if (!work) return;
+
+    work[count++] = start_address;
+    while (count > 0) {
+        unsigned address = work[--count];
+        while (address < vm->memory_size && vm->code[address].xop == xop_decode) {
+            const struct vm_insn *insn = vm_decode_at(vm, address);
+
+            if (insn->xop == xop_call_imm || insn->xop == xop_tailcall_imm
+                    || insn->xop == xop_jump_imm || insn->xop == xop_jz_imm
+                    || insn->xop == xop_jnz_imm || insn->xop == xop_dup_jnz_imm
+                    || insn->xop == xop_jump_rel || insn->xop == xop_jz_rel
+                    || insn->xop == xop_jnz_rel || insn->xop == xop_dup_jnz_rel) {
+                if (count == capacity) {
+                    unsigned *new_work = realloc(work, capacity * 2 * sizeof(unsigned));
+                    if (!new_work) break;
+                    work = new_work;
+                    capacity *= 2;
+                }
+                work[count++] = insn->operand;
+            }
+            if (insn->xop == xop_exit || insn->xop == xop_ret
+                    || insn->xop == xop_tailcall || insn->xop == xop_tailcall_imm
+                    || insn->xop == xop_jump || insn->xop == xop_jumprel
+                    || insn->xop == xop_jump_imm || insn->xop == xop_jump_rel
+                    || insn->xop == xop_bad || insn->xop == xop_outside) {
+                break;
+            }
+            address += insn->length;
+        }
+    }
+    free(work);
+}
+
+void vm_invalidate(struct vmstate *vm, unsigned address, unsigned size) {
+    unsigned first = address >= VM_MAX_SPAN ? address - VM_MAX_SPAN + 1 : 0;
+    unsigned end = address + size;
+    if (end > vm->memory_size || end < address) {
+        end = vm->memory_size;
+    }
+
+    for (unsigned a = address; a < end; ++a) {
+        if (vm->code_marks[a] & VM_MARK_VERIFIED) {
+            vm->code_verified = 0;
+        }
+        if (vm->jit && (vm->code_marks[a] & VM_MARK_CODE)) {
+            vm_jit_code_written(vm);
+        }
+    }
+
+    for (unsigned a = first; a < end; ++a) {
+        struct vm_insn *insn = &vm->code[a];
+        if ((vm->code_marks[a] & VM_MARK_CODE) && insn->xop != xop_decode && a + insn->length > address) {
+            /* keep the length so a handler that overwrote its own
+             * bytecode still advances past it */
+            insn->xop = xop_decode;
+        }
+    }
+}
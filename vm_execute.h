@@ -0,0 +1,499 @@
+/* ************************************************************************* *
+ * INTERPRETER LOOP                                                          *
+ * ************************************************************************* *
+ * Not a normal header: vmcore.c includes this twice to build vm_execute,
+ * with VM_CHECKED set to 1, and vm_execute_verified, with VM_CHECKED set to
+ * 0 for code vm_verify has already proven safe. Handlers test VM_CHECKED
+ * directly so the unneeded checks fold away in the verified copy.
+ */
+int VM_EXECUTE(struct vmstate *vm, unsigned start_address) {
+
+#ifdef VM_THREADED
+    static const void *dispatch_table[xop_count] = {
+        [xop_decode]    = &&do_xop_decode,
+        [xop_outside]   = &&do_xop_outside,
+        [xop_bad]       = &&do_xop_bad,
+        [xop_exit]      = &&do_xop_exit,
+        [xop_stkdup]    = &&do_xop_stkdup,
+        [xop_push]      = &&do_xop_push,
+        [xop_readb]     = &&do_xop_readb,
+        [xop_reads]     = &&do_xop_reads,
+        [xop_readw]     = &&do_xop_readw,
+        [xop_storeb]    = &&do_xop_storeb,
+        [xop_stores]    = &&do_xop_stores,
+        [xop_storew]    = &&do_xop_storew,
+        [xop_add]       = &&do_xop_add,
+        [xop_sub]       = &&do_xop_sub,
+        [xop_mul]       = &&do_xop_mul,
+        [xop_div]       = &&do_xop_div,
+        [xop_mod]       = &&do_xop_mod,
+        [xop_inc]       = &&do_xop_inc,
+        [xop_dec]       = &&do_xop_dec,
+        [xop_gets]      = &&do_xop_gets,
+        [xop_saynum]    = &&do_xop_saynum,
+        [xop_saychar]   = &&do_xop_saychar,
+        [xop_saystr]    = &&do_xop_saystr,
+        [xop_memcpy]    = &&do_xop_memcpy,
+        [xop_memset]    = &&do_xop_memset,
+        [xop_memcmp]    = &&do_xop_memcmp,
+        [xop_memchr]    = &&do_xop_memchr,
+        [xop_call]      = &&do_xop_call,
+        [xop_ret]       = &&do_xop_ret,
+        [xop_tailcall]  = &&do_xop_tailcall,
+        [xop_jump]      = &&do_xop_jump,
+        [xop_jumprel]   = &&do_xop_jumprel,
+        [xop_jz]        = &&do_xop_jz,
+        [xop_jnz]       = &&do_xop_jnz,
+        [xop_getframe]  = &&do_xop_getframe,
+        [xop_setframe]  = &&do_xop_setframe,
+        [xop_readb_imm]     = &&do_xop_readb_imm,
+        [xop_reads_imm]     = &&do_xop_reads_imm,
+        [xop_readw_imm]     = &&do_xop_readw_imm,
+        [xop_storeb_imm]    = &&do_xop_storeb_imm,
+        [xop_stores_imm]    = &&do_xop_stores_imm,
+        [xop_storew_imm]    = &&do_xop_storew_imm,
+        [xop_add_imm]       = &&do_xop_add_imm,
+        [xop_sub_imm]       = &&do_xop_sub_imm,
+        [xop_saychar_imm]   = &&do_xop_saychar_imm,
+        [xop_saystr_imm]    = &&do_xop_saystr_imm,
+        [xop_call_imm]      = &&do_xop_call_imm,
+        [xop_tailcall_imm]  = &&do_xop_tailcall_imm,
+        [xop_jump_imm]      = &&do_xop_jump_imm,
+        [xop_jz_imm]        = &&do_xop_jz_imm,
+        [xop_jnz_imm]       = &&do_xop_jnz_imm,
+        [xop_dup_jnz_imm]   = &&do_xop_dup_jnz_imm,
+        [xop_jump_rel]      = &&do_xop_jump_rel,
+        [xop_jz_rel]        = &&do_xop_jz_rel,
+        [xop_jnz_rel]       = &&do_xop_jnz_rel,
+        [xop_dup_jnz_rel]   = &&do_xop_dup_jnz_rel,
+    };
+#endif
+
+    unsigned operand, operand2;
+    int value;
+    const struct vm_insn *ip;
+    long budget = vm->budget;
+    unsigned long retired = 0;
+    /* a copy, which stores to fixed_memory cannot make stale */
+    struct vm_stats *const stats = vm->stats;
+#ifdef TOYVM_TOS
+    int *sp, tos;
+#endif
+#ifdef TOYVM_OPCOUNT
+    struct vm_opcount_history opcount_history = { 0, 0 };
+#endif
+    vm_translate(vm, start_address);
+    ip = &vm->code[start_address];
+    RELOAD();
+
+    VM_DISPATCH_BEGIN
+        CASE(xop_decode)
+            RETIRED(-1);
+            if (!VM_CHECKED && !vm->code_verified) {
+                /* verified code was written to; the proof no longer holds */
+                SPILL();
+                FLUSH_RETIRED();
+                vm->budget = budget;
+                return vm_execute(vm, ip - vm->code);
+            }
+            ip = vm_decode_at(vm, ip - vm->code);
+            DISPATCH;
+        CASE(xop_outside)
+            vm_pc_error(vm, ip - vm->code);
+            VM_RETURN(0);
+        CASE(xop_bad)
+            fprintf(stderr,
+                    "Tried to execute unknown instruction 0x%X at address 0x%08lX.\n",
+                    vm->fixed_memory[ip - vm->code], ip - vm->code + 1);
+            VM_RETURN(0);
+
+        CASE(xop_exit)
+            VM_RETURN(1);
+
+        CASE(xop_stkdup)
+            MIN_STACK(vm, 1);
+            PUSH_PC();
+            PUSH(TOP);
+            NEXT;
+
+        CASE(xop_push)
+            PUSH_PC();
+            PUSH(ip->operand);
+            NEXT_LONG;
+        CASE(xop_readb)
+            MIN_STACK(vm, 1);
+            FAULT_PC();
+            TOP = vm_read_byte(vm, TOP);
+            COUNT(bytes_read, 1);
+            NEXT;
+        CASE(xop_reads)
+            MIN_STACK(vm, 1);
+            FAULT_PC();
+            TOP = vm_read_short(vm, TOP);
+            COUNT(bytes_read, 2);
+            NEXT;
+        CASE(xop_readw)
+            MIN_STACK(vm, 1);
+            FAULT_PC();
+            TOP = vm_read_word(vm, TOP);
+            COUNT(bytes_read, 4);
+            NEXT;
+        CASE(xop_storeb)
+            MIN_STACK(vm, 2);
+            FAULT_PC();
+            POP_TO(operand);
+            POP_TO(value);
+            vm_store_byte(vm, operand, value);
+            COUNT(bytes_written, 1);
+            NEXT;
+        CASE(xop_stores)
+            MIN_STACK(vm, 2);
+            FAULT_PC();
+            POP_TO(operand);
+            POP_TO(value);
+            vm_store_short(vm, operand, value);
+            COUNT(bytes_written, 2);
+            NEXT;
+        CASE(xop_storew)
+            MIN_STACK(vm, 2);
+            FAULT_PC();
+            POP_TO(operand);
+            POP_TO(value);
+            vm_store_word(vm, operand, value);
+            COUNT(bytes_written, 4);
+            NEXT;
+
+        CASE(xop_getframe)
+            FRAME_SLOT(vm, ip->operand, 0);
+            PUSH_PC();
+            SYNC_TOP();
+            PUSH(vm->frame_ptr[ip->operand]);
+            NEXT_LONG;
+        CASE(xop_setframe)
+            MIN_STACK(vm, 1);
+            FRAME_SLOT(vm, ip->operand, 1);
+            /* stored before the pop, which may reload it as the new top */
+            vm->frame_ptr[ip->operand] = TOP;
+            POP_TO(value);
+            NEXT_LONG;
+
+        CASE(xop_add)
+            MIN_STACK(vm, 2);
+            POP_TO(value);
+            TOP = TOP + value;
+            NEXT;
+        CASE(xop_sub)
+            MIN_STACK(vm, 2);
+            POP_TO(value);
+            TOP = TOP - value;
+            NEXT;
+        CASE(xop_mul)
+            MIN_STACK(vm, 2);
+            POP_TO(value);
+            TOP = TOP * value;
+            NEXT;
+        CASE(xop_div)
+            MIN_STACK(vm, 2);
+            POP_TO(value);
+            TOP = TOP / value;
+            NEXT;
+        CASE(xop_mod)
+            MIN_STACK(vm, 2);
+            POP_TO(value);
+            TOP = TOP % value;
+            NEXT;
+        CASE(xop_inc)
+            MIN_STACK(vm, 1);
+            TOP = TOP + 1;
+            NEXT;
+        CASE(xop_dec)
+            MIN_STACK(vm, 1);
+            TOP = TOP - 1;
+            NEXT;
+
+        CASE(xop_gets)
+            if (!vm_input_ready(vm)) {
+                /* come back to this gets once there is a line for it */
+                vm->resume_pc = ip - vm->code;
+                vm->resume_verified = !VM_CHECKED;
+                VM_RETURN(vm_status_waiting);
+            }
+            POP_TO(operand);
+            POP_TO(operand2);
+            SPILL();
+            vm_io_gets(vm, operand, operand2);
+            NEXT;
+        CASE(xop_saynum)
+            MIN_STACK(vm, 1);
+            POP_TO(value);
+            SPILL();
+            vm_io_saynum(vm, value);
+            NEXT;
+        CASE(xop_saychar)
+            MIN_STACK(vm, 1);
+            POP_TO(value);
+            SPILL();
+            vm_io_saychar(vm, value);
+            NEXT;
+        CASE(xop_saystr)
+            MIN_STACK(vm, 1);
+            POP_TO(operand);
+            SPILL();
+            vm_io_saystr(vm, operand);
+            NEXT;
+
+        CASE(xop_memcpy)
+            MIN_STACK(vm, 3);
+            FAULT_PC();
+            POP_TO(value);
+            POP_TO(operand2);
+            POP_TO(operand);
+            if (!vm_mem_copy(vm, operand, operand2, value)) {
+                VM_RETURN(0);
+            }
+            NEXT;
+        CASE(xop_memset)
+            MIN_STACK(vm, 3);
+            FAULT_PC();
+            POP_TO(value);
+            POP_TO(operand2);
+            POP_TO(operand);
+            if (!vm_mem_fill(vm, operand, operand2, value)) {
+                VM_RETURN(0);
+            }
+            NEXT;
+        CASE(xop_memcmp)
+            MIN_STACK(vm, 3);
+            FAULT_PC();
+            POP_TO(value);
+            POP_TO(operand2);
+            if (!vm_mem_compare(vm, TOP, operand2, value, &value)) {
+                VM_RETURN(0);
+            }
+            TOP = value;
+            NEXT;
+        CASE(xop_memchr)
+            MIN_STACK(vm, 3);
+            FAULT_PC();
+            POP_TO(value);
+            POP_TO(operand2);
+            if (!vm_mem_find(vm, TOP, operand2, value, &operand)) {
+                VM_RETURN(0);
+            }
+            TOP = operand;
+            NEXT;
+
+        CASE(xop_call)
+            MIN_STACK(vm, 1);
+            POP_TO(operand);
+            FRAME_ROOM(vm, operand);
+            SPILL();
+            PUSH_FRAME(vm, operand);
+            RELOAD();
+            SAMPLE_PC(operand);
+            CHECKPOINT(operand, 1);
+            JUMP(operand);
+        CASE(xop_call_imm)
+            RETIRED(1);
+            FRAME_ROOM(vm, ip->operand);
+            SPILL();
+            PUSH_FRAME(vm, ip->operand);
+            RELOAD();
+            SAMPLE_PC(ip->operand);
+            CHECKPOINT(ip->operand, ip->cost);
+            ip = &vm->code[ip->operand];
+            DISPATCH;
+        CASE(xop_ret)
+            MIN_STACK(vm, 1);
+            HAS_CALLER(vm);
+            SPILL();
+            operand = vm_pop_frame(vm);
+            RELOAD();
+            SAMPLE_PC(operand);
+            /* a return address is at most one past the end of memory,
+             * where vm->code has its xop_outside sentinel */
+            ip = &vm->code[operand];
+            DISPATCH;
+        CASE(xop_tailcall)
+            MIN_STACK(vm, 1);
+            POP_TO(operand);
+            value = vm_tail_args(vm, operand);
+            if (value < 0) {
+                /* not proven: a call, back to the ret after this */
+                FRAME_ROOM(vm, operand);
+                SPILL();
+                PUSH_FRAME(vm, operand);
+                RELOAD();
+            } else {
+                /* the frame is reused, so the room for the callee's is
+                 * only known once its arguments have moved */
+                SPILL();
+                vm_tail_frame(vm, operand, value);
+                RELOAD();
+                FRAME_ROOM(vm, operand);
+            }
+            SAMPLE_PC(operand);
+            CHECKPOINT(operand, 1);
+            JUMP(operand);
+        CASE(xop_tailcall_imm)
+            RETIRED(1);
+            if (!vm->code_verified) {
+                /* the callee may have changed since its arguments were
+                 * counted, so call it as an unproven one */
+                FRAME_ROOM(vm, ip->operand);
+                SPILL();
+                PUSH_FRAME(vm, ip->operand);
+                RELOAD();
+            } else {
+                SPILL();
+                vm_tail_frame(vm, ip->operand, ip->cost);
+                RELOAD();
+                FRAME_ROOM(vm, ip->operand);
+            }
+            SAMPLE_PC(ip->operand);
+            CHECKPOINT(ip->operand, 1);
+            ip = &vm->code[ip->operand];
+            DISPATCH;
+
+        CASE(xop_jump)
+            MIN_STACK(vm, 1);
+            POP_TO(operand);
+            BRANCH(operand);
+        CASE(xop_jumprel)
+            MIN_STACK(vm, 1);
+            POP_TO(value);
+            operand = ip - vm->code + value;
+            BRANCH(operand);
+        CASE(xop_jz)
+            MIN_STACK(vm, 2);
+            POP_TO(operand);
+            POP_TO(value);
+            if (value == 0) {
+                BRANCH(operand);
+            }
+            NEXT;
+        CASE(xop_jnz)
+            MIN_STACK(vm, 2);
+            POP_TO(operand);
+            POP_TO(value);
+            if (value != 0) {
+                BRANCH(operand);
+            }
+            NEXT;
+
+        /* the fused forms count their push and go on as the branch alone;
+         * only a relative branch can have a target outside memory */
+        CASE(xop_jump_imm)
+            RETIRED(1);
+            /* fall through */
+        CASE(xop_jump_rel)
+            if (ip->cost) {
+                CHECKPOINT(ip->operand, ip->cost);
+            }
+            JUMP(ip->operand);
+        CASE(xop_jz_imm)
+            RETIRED(1);
+            /* fall through */
+        CASE(xop_jz_rel)
+            MIN_STACK(vm, 1);
+            POP_TO(value);
+            if (value == 0) {
+                if (ip->cost) {
+                    CHECKPOINT(ip->operand, ip->cost);
+                }
+                JUMP(ip->operand);
+            }
+            NEXT_LONG;
+        CASE(xop_jnz_imm)
+            RETIRED(1);
+            /* fall through */
+        CASE(xop_jnz_rel)
+            MIN_STACK(vm, 1);
+            POP_TO(value);
+            if (value != 0) {
+                if (ip->cost) {
+                    CHECKPOINT(ip->operand, ip->cost);
+                }
+                JUMP(ip->operand);
+            }
+            NEXT_LONG;
+        CASE(xop_dup_jnz_imm)
+            RETIRED(1);
+            /* fall through */
+        CASE(xop_dup_jnz_rel)
+            RETIRED(1);
+            MIN_STACK(vm, 1);
+            if (TOP != 0) {
+                if (ip->cost) {
+                    CHECKPOINT(ip->operand, ip->cost);
+                }
+                JUMP(ip->operand);
+            }
+            NEXT_LONG;
+
+        CASE(xop_readb_imm)
+            FAULT_PC_LAST();
+            PUSH(vm_read_byte(vm, ip->operand));
+            RETIRED(1);
+            COUNT(bytes_read, 1);
+            NEXT_LONG;
+        CASE(xop_reads_imm)
+            FAULT_PC_LAST();
+            PUSH(vm_read_short(vm, ip->operand));
+            RETIRED(1);
+            COUNT(bytes_read, 2);
+            NEXT_LONG;
+        CASE(xop_readw_imm)
+            FAULT_PC_LAST();
+            PUSH(vm_read_word(vm, ip->operand));
+            RETIRED(1);
+            COUNT(bytes_read, 4);
+            NEXT_LONG;
+        CASE(xop_storeb_imm)
+            MIN_STACK(vm, 1);
+            FAULT_PC_LAST();
+            POP_TO(value);
+            vm_store_byte(vm, ip->operand, value);
+            RETIRED(1);
+            COUNT(bytes_written, 1);
+            NEXT_LONG;
+        CASE(xop_stores_imm)
+            MIN_STACK(vm, 1);
+            FAULT_PC_LAST();
+            POP_TO(value);
+            vm_store_short(vm, ip->operand, value);
+            RETIRED(1);
+            COUNT(bytes_written, 2);
+            NEXT_LONG;
+        CASE(xop_storew_imm)
+            MIN_STACK(vm, 1);
+            FAULT_PC_LAST();
+            POP_TO(value);
+            vm_store_word(vm, ip->operand, value);
+            RETIRED(1);
+            COUNT(bytes_written, 4);
+            NEXT_LONG;
+        CASE(xop_add_imm)
+            MIN_STACK(vm, 1);
+            TOP = TOP + ip->operand;
+            RETIRED(1);
+            NEXT_LONG;
+        CASE(xop_sub_imm)
+            MIN_STACK(vm, 1);
+            TOP = TOP - ip->operand;
+            RETIRED(1);
+            NEXT_LONG;
+        CASE(xop_saychar_imm)
+            RETIRED(1);
+            SPILL();
+            vm_io_saychar(vm, ip->operand);
+            NEXT_LONG;
+        CASE(xop_saystr_imm)
+            RETIRED(1);
+            SPILL();
+            vm_io_saystr(vm, ip->operand);
+            NEXT_LONG;
+    VM_DISPATCH_END
+
+    return 1;
+}
@@ -0,0 +1,119 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * EXPORT INDEX                                                              *
+ * ************************************************************************* *
+ * The export table written by the assembler is a count followed by fixed
+ * size entries of a 16 byte name and a 4 byte address. vm_export_init
+ * hashes every name into an open addressing table of entry numbers once,
+ * so looking an export up by name costs one hash and usually one compare.
+ * The entry number doubles as the handle returned by vm_find_export; the
+ * address itself is always read from the table, as before.
+ */
+
+struct vm_export_index {
+    unsigned *slots;        /* entry number + 1, or 0 if empty */
+    unsigned mask;
+    unsigned count;
+};
+
+static uint32_t hash_name(const char *name, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; ++i) {
+        hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return hash;
+}
+
+static const char* entry_name(struct vmstate *vm, unsigned entry) {
+    return (const char*)&vm->fixed_memory[EXPORT_FIRST + entry * EXPORT_SIZE];
+}
+
+/* Length of an export's name, which is only terminated if shorter than
+ * EXPORT_NAME_SIZE. */
+static size_t entry_name_length(const char *name) {
+    const char *end = memchr(name, 0, EXPORT_NAME_SIZE);
+    return end ? (size_t)(end - name) : EXPORT_NAME_SIZE;
+}
+
+/* Returns the slot holding name, or the empty slot where it would go. */
+static unsigned* find_slot(struct vmstate *vm, const char *name, size_t length) {
+    struct vm_export_index *index = vm->exports;
+    unsigned slot = hash_name(name, length) & index->mask;
+    while (index->slots[slot]) {
+        const char *candidate = entry_name(vm, index->slots[slot] - 1);
+        if (entry_name_length(candidate) == length
+                && memcmp(candidate, name, length) == 0) {
+            break;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    return &index->slots[slot];
+}
+
+int vm_export_init(struct vmstate *vm) {
+    unsigned count = 0, size = 1;
+
+    vm->exports = calloc(1, sizeof(struct vm_export_index));
+    if (!vm->exports) {
+        return 0;
+    }
+    if (vm->memory_size >= EXPORT_FIRST) {
+        count = vm_read_word(vm, EXPORT_COUNT_POS);
+        if (count > (vm->memory_size - EXPORT_FIRST) / EXPORT_SIZE) {
+            count = (vm->memory_size - EXPORT_FIRST) / EXPORT_SIZE;
+        }
+    }
+    while (size < count * 2) {
+        size *= 2;
+    }
+    vm->exports->slots = calloc(size, sizeof(unsigned));
+    if (!vm->exports->slots) {
+        vm_export_free(vm);
+        return 0;
+    }
+    vm->exports->mask = size - 1;
+    vm->exports->count = count;
+
+    for (unsigned i = 0; i < count; ++i) {
+        const char *name = entry_name(vm, i);
+        unsigned *slot = find_slot(vm, name, entry_name_length(name));
+        /* the first of two exports with the same name wins, as before */
+        if (!*slot) {
+            *slot = i + 1;
+        }
+    }
+    return 1;
+}
+
+void vm_export_free(struct vmstate *vm) {
+    if (vm->exports) {
+        free(vm->exports->slots);
+        free(vm->exports);
+        vm->exports = NULL;
+    }
+}
+
+int vm_find_export(struct vmstate *vm, const char *name) {
+    size_t length = strlen(name);
+    if (length > EXPORT_NAME_SIZE) {
+        return -1;
+    }
+    return (int)*find_slot(vm, name, length) - 1;
+}
+
+int vm_export_address(struct vmstate *vm, int handle) {
+    if (handle < 0 || (unsigned)handle >= vm->exports->count) {
+        return -1;
+    }
+    return vm_read_word(vm, EXPORT_FIRST + handle * EXPORT_SIZE + EXPORT_NAME_SIZE);
+}
+
+int vm_get_export(struct vmstate *vm, const char *name) {
+    return vm_export_address(vm, vm_find_export(vm, name));
+}
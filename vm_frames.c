@@ -0,0 +1,197 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * RETURN STACK                                                              *
+ * ************************************************************************* *
+ * call and ret keep the return address and the caller's frame in a struct
+ * vm_frame rather than on the data stack, so nothing a program does to its
+ * stack can send a ret anywhere but back to its call, and the host can
+ * walk the calls in progress through vm_call_stack.
+ *
+ * Frames come from a pool that only grows: chunks of them, each as large
+ * as all the ones before it, linked into one list through next and prev
+ * when they are allocated and never freed before the VM is.
+ * vm->call_frame is the innermost call, so a call takes call_frame->next
+ * and a ret goes back to call_frame->prev, without allocating anything
+ * once calls have been that deep before. The first frame of the first
+ * chunk is the outermost one, for the function vm_start ran, with nowhere
+ * to return to.
+ *
+ * Calls may nest as deep as they could when each one took two entries of
+ * the data stack, half as many as the stack has room for.
+ *
+ * A tail call to a function vm_verify has proven reuses the frame it is
+ * made from, so a chain of them runs in one frame however long it gets,
+ * and the callee's ret goes straight back to where the frame's first call
+ * came from. The verifier has counted the callee's arguments: the decoder
+ * keeps the count in the tailcall_imm entry, and a tailcall that takes its
+ * target off the stack looks it up with vm_tail_args. The arguments are
+ * moved down to ret_base, over everything the frame had pushed, so the
+ * data stack stays the same size too. A callee that has not been proven
+ * is called instead, and returns to the ret that follows every tailcall,
+ * using a frame and stack just as a call followed by a ret would.
+ */
+#define FRAME_CHUNK         64
+
+struct vm_frame_chunk {
+    struct vm_frame_chunk *next;
+    unsigned count;
+    struct vm_frame frames[];
+};
+
+static struct vm_frame_chunk* new_chunk(unsigned count) {
+    struct vm_frame_chunk *chunk = malloc(sizeof(struct vm_frame_chunk)
+                                          + count * sizeof(struct vm_frame));
+    if (!chunk) {
+        return NULL;
+    }
+    chunk->next = NULL;
+    chunk->count = count;
+    for (unsigned i = 0; i < count; ++i) {
+        chunk->frames[i].prev = i > 0 ? &chunk->frames[i - 1] : NULL;
+        chunk->frames[i].next = i + 1 < count ? &chunk->frames[i + 1] : NULL;
+    }
+    return chunk;
+}
+
+int vm_frames_init(struct vmstate *vm) {
+    vm->frame_chunks = new_chunk(FRAME_CHUNK);
+    if (!vm->frame_chunks) {
+        return 0;
+    }
+    vm->call_frame = &vm->frame_chunks->frames[0];
+    vm->call_frame->func_addr = 0;
+    vm->call_frame->ret_addr = -1;
+    vm->call_frame->base = vm->call_frame->ret_base = 0;
+    return 1;
+}
+
+void vm_frames_free(struct vmstate *vm) {
+    struct vm_frame_chunk *chunk = vm->frame_chunks;
+    while (chunk) {
+        struct vm_frame_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    vm->frame_chunks = NULL;
+    vm->call_frame = NULL;
+}
+
+/* Adds a chunk after the last frame, which is vm->call_frame, and returns
+ * its first frame; NULL if calls may not nest any deeper. */
+struct vm_frame* vm_frames_grow(struct vmstate *vm) {
+    unsigned limit = vm->stack_size / (2 * sizeof(int));
+    unsigned allocated = 0;
+    struct vm_frame_chunk **last = &vm->frame_chunks;
+    while (*last) {
+        allocated += (*last)->count;
+        last = &(*last)->next;
+    }
+    /* the outermost frame is not a call */
+    if (allocated > limit) {
+        return NULL;
+    }
+    unsigned count = allocated > FRAME_CHUNK ? allocated : FRAME_CHUNK;
+    if (count > limit + 1 - allocated) {
+        count = limit + 1 - allocated;
+    }
+    *last = new_chunk(count);
+    if (!*last) {
+        return NULL;
+    }
+    struct vm_frame *first = &(*last)->frames[0];
+    first->prev = vm->call_frame;
+    vm->call_frame->next = first;
+    return first;
+}
+
+/* Back to just the outermost frame, for a run starting at start_address
+ * with whatever is on the stack now. */
+void vm_frames_reset(struct vmstate *vm, unsigned start_address) {
+    vm->call_frame = &vm->frame_chunks->frames[0];
+    vm->call_frame->func_addr = start_address;
+    vm->call_frame->ret_addr = -1;
+    vm->call_frame->base = vm->call_frame->ret_base = vm->frame_ptr - vm->stack;
+}
+
+const struct vm_frame* vm_call_stack(struct vmstate *vm) {
+    return vm->call_frame;
+}
+
+/* For snapshots: the frames from the outermost in, in a new array. */
+struct vm_frame_record* vm_frames_save(struct vmstate *vm, unsigned *count) {
+    const struct vm_frame *frame;
+    *count = 0;
+    for (frame = vm->call_frame; frame; frame = frame->prev) {
+        ++*count;
+    }
+    struct vm_frame_record *records = malloc(*count * sizeof(struct vm_frame_record));
+    if (!records) {
+        return NULL;
+    }
+    unsigned i = *count;
+    for (frame = vm->call_frame; frame; frame = frame->prev) {
+        --i;
+        records[i].func_addr = frame->func_addr;
+        records[i].ret_addr = frame->ret_addr;
+        records[i].base = frame->base;
+        records[i].ret_base = frame->ret_base;
+    }
+    return records;
+}
+
+/* Replaces the calls in progress with records from vm_frames_save, which
+ * must fit the VM's memory and the stack it already has. */
+int vm_frames_load(struct vmstate *vm, const struct vm_frame_record *records,
+                   unsigned count) {
+    long depth = vm->stack_ptr - vm->stack;
+    if (count == 0) {
+        return 0;
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        if (records[i].base < (i > 0 ? records[i - 1].base : 0)
+                || records[i].base > depth
+                || records[i].ret_base < 0 || records[i].ret_base > depth
+                || (i > 0 && (unsigned)records[i].ret_addr > vm->memory_size)) {
+            return 0;
+        }
+    }
+
+    vm->frame_ptr = vm->stack + records[0].base;
+    vm_frames_reset(vm, records[0].func_addr);
+    vm->call_frame->ret_base = records[0].ret_base;
+    for (unsigned i = 1; i < count; ++i) {
+        struct vm_frame *frame = vm->call_frame->next;
+        if (!frame && !(frame = vm_frames_grow(vm))) {
+            return 0;
+        }
+        frame->func_addr = records[i].func_addr;
+        frame->ret_addr = records[i].ret_addr;
+        frame->base = records[i].base;
+        frame->ret_base = records[i].ret_base;
+        vm->call_frame = frame;
+    }
+    vm->frame_ptr = vm->stack + vm->call_frame->base;
+    return 1;
+}
+
+/* tailcall: function, which takes args arguments, takes over the current
+ * frame; see above. */
+void vm_tail_frame(struct vmstate *vm, unsigned function, unsigned args) {
+    struct vm_frame *frame = vm->call_frame;
+    int *ret_base = vm->stack + frame->ret_base;
+    if (args > (unsigned)(vm->stack_ptr - ret_base)) {
+        args = vm->stack_ptr - ret_base;
+    }
+    memmove(ret_base, vm->stack_ptr - args, args * sizeof(int));
+    vm->stack_ptr = ret_base + args;
+    frame->func_addr = function;
+    frame->base = vm->stack_ptr - vm->stack;
+    vm->frame_ptr = vm->stack_ptr;
+    VM_STAT_ADD(vm->stats->calls, 1);
+    vm_note_depth(vm);
+}
@@ -0,0 +1,290 @@
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * GUARDED MEMORY AND STACK                                                  *
+ * ************************************************************************* *
+ * The VM's memory image and stack live in their own mappings surrounded by
+ * PROT_NONE pages, so bytecode that reads or writes past the end of either
+ * one faults instead of corrupting the host and nothing on the hot path has
+ * to check.
+ *
+ * The image is placed so that it ends exactly at the first inaccessible
+ * page, and on 64-bit hosts the inaccessible part runs for another 4GB, so
+ * any 32-bit address past memory_size faults. An image mapped straight from
+ * its file has to start on a page boundary instead, so accesses into the
+ * zero-filled rest of its last page are not caught. The stack likewise ends
+ * exactly at a guard page, with the spare slot vm_execute relies on (and
+ * some slack) below it, followed by another guard page.
+ *
+ * vm_guarded_run installs a SIGSEGV handler that turns a fault in either
+ * region into a VM error reporting vm->pc, which the interpreter and the
+ * JIT record before anything that may fault.
+ */
+
+struct vm_guard {
+    unsigned char *memory_region;
+    size_t memory_length;
+    unsigned char *stack_region;
+    size_t stack_length;
+};
+
+static __thread struct vmstate *guarded_vm;
+static __thread sigjmp_buf *guard_jump;
+static __thread unsigned char *fault_address;
+
+static struct sigaction previous_action;
+static volatile sig_atomic_t handler_installed;
+
+static size_t page_size(void) {
+    return sysconf(_SC_PAGESIZE);
+}
+
+static size_t round_to_page(size_t size) {
+    size_t page = page_size();
+    return (size + page - 1) / page * page;
+}
+
+static int in_region(unsigned char *address, unsigned char *region, size_t length) {
+    return region && address >= region && address < region + length;
+}
+
+static void guard_handler(int signal, siginfo_t *info, void *context) {
+    struct vmstate *vm = guarded_vm;
+    unsigned char *address = info->si_addr;
+
+    if (vm && (in_region(address, vm->guard->memory_region, vm->guard->memory_length)
+            || in_region(address, vm->guard->stack_region, vm->guard->stack_length))) {
+        fault_address = address;
+        siglongjmp(*guard_jump, 1);
+    }
+    /* not ours: hand it to whatever handled SIGSEGV before, or failing
+     * that let the fault happen again with the default action */
+    if (previous_action.sa_flags & SA_SIGINFO) {
+        previous_action.sa_sigaction(signal, info, context);
+    } else if (previous_action.sa_handler != SIG_DFL
+               && previous_action.sa_handler != SIG_IGN) {
+        previous_action.sa_handler(signal);
+    } else {
+        handler_installed = 0;
+        sigaction(SIGSEGV, &previous_action, NULL);
+    }
+}
+
+static int install_handler(void) {
+    struct sigaction action;
+    if (handler_installed) {
+        return 1;
+    }
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guard_handler;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGSEGV, &action, &previous_action) != 0) {
+        return 0;
+    }
+    handler_installed = 1;
+    return 1;
+}
+
+/* Reserves the address window for memory_size bytes of image and returns
+ * where the image starts, or NULL. If fd is not -1 the image is mapped
+ * privately from that file at offset, otherwise the caller copies it in. */
+static unsigned char* map_memory(struct vm_guard *guard, unsigned memory_size,
+                                 int fd, off_t offset) {
+    size_t mapped = round_to_page(memory_size);
+    unsigned char *region = MAP_FAILED;
+
+#if UINTPTR_MAX > 0xFFFFFFFFu
+    guard->memory_length = mapped + ((size_t)1 << 32) + page_size();
+    region = mmap(NULL, guard->memory_length, PROT_NONE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#endif
+    if (region == MAP_FAILED) {
+        /* only a single guard page after the image */
+        guard->memory_length = mapped + page_size();
+        region = mmap(NULL, guard->memory_length, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED) {
+            return NULL;
+        }
+    }
+    guard->memory_region = region;
+    if (fd != -1) {
+        if (memory_size > 0 && mmap(region, memory_size, PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_FIXED, fd, offset) == MAP_FAILED) {
+            return NULL;
+        }
+        return region;
+    }
+    if (mapped > 0 && mprotect(region, mapped, PROT_READ | PROT_WRITE) != 0) {
+        return NULL;
+    }
+    return region + (mapped - memory_size);
+}
+
+/* Maps a guarded stack of stack_size bytes and points vm->stack at it. */
+static int map_stack(struct vmstate *vm, unsigned stack_size) {
+    struct vm_guard *guard = vm->guard;
+    size_t page = page_size();
+    size_t usable = round_to_page(stack_size + sizeof(int));
+    size_t length = usable + 2 * page;
+
+    unsigned char *region = mmap(NULL, length, PROT_NONE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        return 0;
+    }
+    if (mprotect(region + page, usable, PROT_READ | PROT_WRITE) != 0) {
+        munmap(region, length);
+        return 0;
+    }
+    if (guard->stack_region) {
+        munmap(guard->stack_region, guard->stack_length);
+    }
+    guard->stack_region = region;
+    guard->stack_length = length;
+
+    vm->stack_size = stack_size;
+    vm->stack = (int*)(region + page + usable - stack_size);
+    vm->stack_ptr = vm->stack;
+    vm->frame_ptr = NULL;
+    return 1;
+}
+
+static int guard_init(struct vmstate *vm, unsigned memory_size, int fd,
+                      off_t offset, unsigned stack_size) {
+    vm->guard = calloc(1, sizeof(struct vm_guard));
+    if (!vm->guard) {
+        return 0;
+    }
+    vm->fixed_memory = map_memory(vm->guard, memory_size, fd, offset);
+    if (!vm->fixed_memory || !map_stack(vm, stack_size) || !install_handler()) {
+        vm_guard_free(vm);
+        return 0;
+    }
+    return 1;
+}
+
+int vm_guard_init(struct vmstate *vm, unsigned memory_size,
+                  const unsigned char *memory_source, unsigned stack_size) {
+    if (!guard_init(vm, memory_size, -1, 0, stack_size)) {
+        return 0;
+    }
+    memcpy(vm->fixed_memory, memory_source, memory_size);
+    return 1;
+}
+
+/* Sets vm->memory_size from the file as well. */
+int vm_guard_init_file(struct vmstate *vm, const char *filename,
+                       unsigned stack_size) {
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size > UINT_MAX) {
+        close(fd);
+        return 0;
+    }
+    vm->memory_size = info.st_size;
+    int result = guard_init(vm, vm->memory_size, fd, 0, stack_size);
+    close(fd);
+    return result;
+}
+
+/* As vm_guard_init_file, for memory_size bytes of an open file starting at
+ * offset, which must be a multiple of the page size. */
+int vm_guard_init_fd(struct vmstate *vm, int fd, off_t offset,
+                     unsigned memory_size, unsigned stack_size) {
+    return guard_init(vm, memory_size, fd, offset, stack_size);
+}
+
+int vm_guard_stack(struct vmstate *vm, unsigned stack_size) {
+    stack_size = (stack_size + sizeof(int) - 1) / sizeof(int) * sizeof(int);
+    if (stack_size == 0) {
+        return 0;
+    }
+    return map_stack(vm, stack_size);
+}
+
+/* The writable pages holding the stack, which end where it does. */
+size_t vm_guard_stack_area(struct vmstate *vm, unsigned char **start) {
+    *start = vm->guard->stack_region + page_size();
+    return vm->guard->stack_length - 2 * page_size();
+}
+
+/* Replaces the stack's pages with a private mapping of the same length from
+ * fd at offset, laid out as vm_guard_stack_area describes. */
+int vm_guard_map_stack(struct vmstate *vm, int fd, off_t offset) {
+    unsigned char *start;
+    size_t length = vm_guard_stack_area(vm, &start);
+    return mmap(start, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                fd, offset) != MAP_FAILED;
+}
+
+void vm_guard_free(struct vmstate *vm) {
+    struct vm_guard *guard = vm->guard;
+    if (!guard) return;
+    if (guard->memory_region) {
+        munmap(guard->memory_region, guard->memory_length);
+    }
+    if (guard->stack_region) {
+        munmap(guard->stack_region, guard->stack_length);
+    }
+    free(guard);
+    vm->guard = NULL;
+    vm->fixed_memory = NULL;
+    vm->stack = vm->stack_ptr = vm->frame_ptr = NULL;
+}
+
+/* The VM this thread is running, if any; safe to call from a signal
+ * handler. */
+struct vmstate* vm_guard_current(void) {
+    return guarded_vm;
+}
+
+int vm_guarded_run(struct vmstate *vm,
+                   int (*run)(struct vmstate *vm, unsigned address),
+                   unsigned address) {
+    sigjmp_buf jump;
+    sigjmp_buf *outer_jump = guard_jump;
+    struct vmstate *outer_vm = guarded_vm;
+    int result;
+
+    if (sigsetjmp(jump, 0)) {
+        guard_jump = outer_jump;
+        guarded_vm = outer_vm;
+        vm_flush_output(vm);
+        if (in_region(fault_address, vm->guard->stack_region, vm->guard->stack_length)) {
+            fprintf(stderr, "Instruction at 0x%08X %s the stack.\n", vm->pc,
+                    fault_address < (unsigned char*)vm->stack ? "underflowed" : "overflowed");
+        } else {
+            fprintf(stderr,
+                    "Instruction at 0x%08X accessed memory outside memory sized 0x%08X\n",
+                    vm->pc, vm->memory_size);
+        }
+        return 0;
+    }
+    guard_jump = &jump;
+    guarded_vm = vm;
+    result = run(vm, address);
+    guard_jump = outer_jump;
+    guarded_vm = outer_vm;
+    /* nothing the program said stays buffered once the host has control */
+    vm_flush_output(vm);
+    return result;
+}
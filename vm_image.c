@@ -0,0 +1,224 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * SHARED IMAGES                                                             *
+ * ************************************************************************* *
+ * A vm_image holds a program loaded once for any number of instances. The
+ * image bytes go into a sealed memfd, and so does everything init_state
+ * would otherwise work out again for each instance: vm->code with every
+ * verified export already decoded, code_marks and the verifier's results.
+ * vm_init_image maps all of it MAP_PRIVATE, so instances share those pages
+ * until they write to them, and an instance only pays for the memory,
+ * decoded entries and stack pages it actually changes.
+ */
+
+struct vm_image {
+    int memory_fd;
+    unsigned memory_size;
+    int code_verified;
+
+    /* decoded code, code_marks and functions, each at a page boundary */
+    int state_fd;
+    size_t code_offset, marks_offset, functions_offset;
+};
+
+static size_t round_to_page(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+static size_t code_length(unsigned memory_size) {
+    return round_to_page((memory_size + 1) * sizeof(struct vm_insn));
+}
+
+static size_t marks_length(unsigned memory_size) {
+    return round_to_page(memory_size + sizeof(uint32_t));
+}
+
+static size_t functions_length(unsigned memory_size) {
+    return round_to_page(memory_size > 0 ? memory_size * sizeof(struct vm_function) : 1);
+}
+
+int vm_write_all(int fd, const void *data, size_t length, off_t offset) {
+    const char *bytes = data;
+    while (length > 0) {
+        ssize_t written = pwrite(fd, bytes, length, offset);
+        if (written <= 0) return 0;
+        bytes += written;
+        length -= written;
+        offset += written;
+    }
+    return 1;
+}
+
+/* Writes only the pages that are not all zero, so the parts of a large
+ * image that were never decoded take no memory in the memfd either. */
+int vm_write_sparse(int fd, const void *data, size_t length, off_t offset) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    const unsigned char *bytes = data;
+    for (size_t done = 0; done < length; done += page) {
+        size_t chunk = length - done < page ? length - done : page;
+        for (size_t i = 0; i < chunk; ++i) {
+            if (bytes[done + i]) {
+                if (!vm_write_all(fd, bytes + done, chunk, offset + done)) return 0;
+                break;
+            }
+        }
+    }
+    return 1;
+}
+
+static int sealed_memfd(const char *name, size_t length) {
+    int fd = memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        return -1;
+    }
+    if (ftruncate(fd, length) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int seal(int fd) {
+    return fcntl(fd, F_ADD_SEALS,
+                 F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+}
+
+/* Sets up a throwaway VM on the image and keeps what it worked out. */
+static int build_state(struct vm_image *image, const unsigned char *memory) {
+    struct vmstate vm;
+    if (!vm_init_memory(&vm, image->memory_size, (unsigned char*)memory)) {
+        return 0;
+    }
+    /* vm_run decodes as it goes, but whatever is reachable from the
+     * verified exports can be decoded once here for every instance */
+    unsigned count = vm.memory_size >= EXPORT_FIRST
+                   ? vm_read_word(&vm, EXPORT_COUNT_POS) : 0;
+    for (unsigned handle = 0; handle < count; ++handle) {
+        unsigned address = vm_export_address(&vm, handle);
+        if (address < vm.memory_size
+                && vm.functions[address].status == vm_function_verified) {
+            vm_translate(&vm, address);
+        }
+    }
+
+    image->code_offset = 0;
+    image->marks_offset = code_length(image->memory_size);
+    image->functions_offset = image->marks_offset + marks_length(image->memory_size);
+    image->code_verified = vm.code_verified;
+    image->state_fd = sealed_memfd("toyvm-state", image->functions_offset
+                                   + functions_length(image->memory_size));
+    int ok = image->state_fd != -1
+        && vm_write_sparse(image->state_fd, vm.code,
+                        (image->memory_size + 1) * sizeof(struct vm_insn),
+                        image->code_offset)
+        && vm_write_sparse(image->state_fd, vm.code_marks,
+                        image->memory_size + sizeof(uint32_t), image->marks_offset)
+        && vm_write_sparse(image->state_fd, vm.functions,
+                        image->memory_size * sizeof(struct vm_function),
+                        image->functions_offset)
+        && seal(image->state_fd);
+    vm_free(&vm);
+    return ok;
+}
+
+/* memory can be freed once this returns. */
+struct vm_image* vm_image_create(unsigned memory_size, const unsigned char *memory) {
+    struct vm_image *image = calloc(1, sizeof(struct vm_image));
+    if (!image) {
+        return NULL;
+    }
+    image->memory_size = memory_size;
+    image->state_fd = -1;
+    image->memory_fd = sealed_memfd("toyvm-image", memory_size);
+    if (image->memory_fd == -1
+            || !vm_write_all(image->memory_fd, memory, memory_size, 0)
+            || !seal(image->memory_fd)
+            || !build_state(image, memory)) {
+        vm_image_free(image);
+        return NULL;
+    }
+    return image;
+}
+
+struct vm_image* vm_image_load(const char *filename) {
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &info) != 0 || info.st_size > UINT_MAX) {
+        close(fd);
+        return NULL;
+    }
+    unsigned size = info.st_size;
+    void *memory = size > 0 ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+    close(fd);
+    if (memory == MAP_FAILED) {
+        return NULL;
+    }
+    struct vm_image *image = vm_image_create(size, memory);
+    if (size > 0) {
+        munmap(memory, size);
+    }
+    return image;
+}
+
+/* Instances made from the image keep working after it is freed. */
+void vm_image_free(struct vm_image *image) {
+    if (!image) return;
+    if (image->memory_fd != -1) close(image->memory_fd);
+    if (image->state_fd != -1) close(image->state_fd);
+    free(image);
+}
+
+int vm_image_map_memory(struct vmstate *vm, const struct vm_image *image) {
+    vm->memory_size = image->memory_size;
+    return vm_guard_init_fd(vm, image->memory_fd, 0, image->memory_size,
+                            VM_DEFAULT_STACK_SIZE);
+}
+
+static void* map_state(const struct vm_image *image, size_t length, size_t offset) {
+    void *state = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                       image->state_fd, offset);
+    return state == MAP_FAILED ? NULL : state;
+}
+
+/* Stands in for vm_decode_init and vm_verify_init. */
+int vm_image_map_state(struct vmstate *vm, const struct vm_image *image) {
+    vm->code = map_state(image, code_length(vm->memory_size), image->code_offset);
+    vm->code_marks = map_state(image, marks_length(vm->memory_size), image->marks_offset);
+    vm->functions = map_state(image, functions_length(vm->memory_size),
+                              image->functions_offset);
+    vm->state_mapped = 1;
+    if (!vm->code || !vm->code_marks || !vm->functions) {
+        vm_image_unmap_state(vm);
+        return 0;
+    }
+    vm->code_verified = image->code_verified;
+    return 1;
+}
+
+/* Called by vm_free before vm_decode_free and vm_verify_free, which then
+ * have nothing left to free. */
+void vm_image_unmap_state(struct vmstate *vm) {
+    if (!vm->state_mapped) return;
+    if (vm->code) munmap(vm->code, code_length(vm->memory_size));
+    if (vm->code_marks) munmap(vm->code_marks, marks_length(vm->memory_size));
+    if (vm->functions) munmap(vm->functions, functions_length(vm->memory_size));
+    vm->code = NULL;
+    vm->code_marks = NULL;
+    vm->functions = NULL;
+    vm->state_mapped = 0;
+}
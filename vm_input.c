@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * INPUT                                                                     *
+ * ************************************************************************* *
+ * gets reads a line from stdin unless the host has started handing the VM
+ * its input with vm_provide_input. From then on gets takes lines from a
+ * per-VM queue, and when the queue holds no complete line it does not
+ * block: vm_run_for returns vm_status_waiting with the VM ready to run the
+ * same gets again once more input (or vm_close_input) has arrived.
+ */
+
+struct vm_input {
+    char *buffer;
+    unsigned start, length, capacity;
+    int closed;
+};
+
+static struct vm_input* queue(struct vmstate *vm) {
+    if (!vm->input) {
+        vm->input = calloc(1, sizeof(struct vm_input));
+    }
+    return vm->input;
+}
+
+void vm_provide_input(struct vmstate *vm, const char *text, unsigned length) {
+    struct vm_input *in = queue(vm);
+    if (!in || length == 0) {
+        return;
+    }
+    if (in->start > 0) {
+        memmove(in->buffer, &in->buffer[in->start], in->length);
+        in->start = 0;
+    }
+    if (length > in->capacity - in->length) {
+        unsigned capacity = in->capacity ? in->capacity : 256;
+        while (capacity - in->length < length) {
+            capacity *= 2;
+        }
+        char *buffer = realloc(in->buffer, capacity);
+        if (!buffer) return;
+        in->buffer = buffer;
+        in->capacity = capacity;
+    }
+    memcpy(&in->buffer[in->length], text, length);
+    in->length += length;
+}
+
+/* After the queued input runs out, gets sees end of file. */
+void vm_close_input(struct vmstate *vm) {
+    struct vm_input *in = queue(vm);
+    if (in) {
+        in->closed = 1;
+    }
+}
+
+void vm_input_free(struct vmstate *vm) {
+    if (vm->input) {
+        free(vm->input->buffer);
+        free(vm->input);
+        vm->input = NULL;
+    }
+}
+
+int vm_input_ready(struct vmstate *vm) {
+    struct vm_input *in = vm->input;
+    return !in || in->closed
+        || (in->length > 0 && memchr(&in->buffer[in->start], '\n', in->length));
+}
+
+/* As fgets, from the queue: leaves dest alone and returns 0 at end of
+ * input. */
+static int read_queued(struct vm_input *in, char *dest, unsigned size) {
+    if (size == 0 || in->length == 0) {
+        return 0;
+    }
+    const char *line = &in->buffer[in->start];
+    const char *newline = memchr(line, '\n', in->length);
+    unsigned length = newline ? (unsigned)(newline - line) + 1 : in->length;
+    if (length > size - 1) {
+        length = size - 1;
+    }
+    memcpy(dest, line, length);
+    dest[length] = 0;
+    in->start += length;
+    in->length -= length;
+    return 1;
+}
+
+/* The I/O operations keep to memory themselves rather than rely on the
+ * guard pages; a fault inside stdio would leave its locks held. */
+void vm_io_gets(struct vmstate *vm, unsigned address, unsigned size) {
+    VM_STAT_ADD(vm->stats->io_ops, 1);
+    if (address >= vm->memory_size - 1 || vm->memory_size < 2) {
+        return;
+    }
+    if (size > vm->memory_size - address - 1) {
+        size = vm->memory_size - address - 1;
+    }
+    vm_mark_dirty(vm, address, size + 1);
+    vm_invalidate(vm, address, size + 1);
+    /* show any prompt before waiting for the answer */
+    vm_flush_output(vm);
+    char *dest = (char*)&vm->fixed_memory[address + 1];
+    if (vm->input) {
+        read_queued(vm->input, dest, size);
+    } else {
+        fgets(dest, size, stdin);
+    }
+    unsigned length = strlen(dest);
+    vm->fixed_memory[address] = length;
+    vm->fixed_memory[address + length] = 0;
+    VM_STAT_ADD(vm->stats->bytes_written, length + 1);
+}
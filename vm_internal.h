@@ -0,0 +1,457 @@
+#ifndef VM_INTERNAL_H
+#define VM_INTERNAL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "opcode.h"
+#include "toyvm.h"
+
+#define EXPORT_COUNT_POS    12
+#define EXPORT_FIRST        16
+#define EXPORT_NAME_SIZE    16
+#define EXPORT_SIZE         20
+
+/* the hash index of the export table; see vm_export.c */
+int vm_export_init(struct vmstate *vm);
+void vm_export_free(struct vmstate *vm);
+
+/* the output buffer; see vm_output.c */
+int vm_output_init(struct vmstate *vm);
+void vm_output_free(struct vmstate *vm);
+
+/* the input queue; see vm_input.c */
+void vm_input_free(struct vmstate *vm);
+int vm_input_ready(struct vmstate *vm);
+
+#define VM_DEFAULT_STACK_SIZE   512
+
+/* ************************************************************************* *
+ * DECODED INSTRUCTIONS                                                      *
+ * ************************************************************************* *
+ * vm_run does not execute the raw bytecode in fixed_memory. Instead every
+ * address that is executed gets a decoded entry in vm->code holding the
+ * handler to run, the immediate operand already assembled and, where it is
+ * known at decode time, the branch target already range checked.
+ */
+enum vm_xop {
+    xop_decode,         /* not decoded yet (or invalidated by a store) */
+    xop_outside,        /* sentinel one past the end of memory */
+    xop_bad,            /* unknown opcode */
+
+    xop_exit,
+    xop_stkdup,
+    xop_push,
+    xop_readb,
+    xop_reads,
+    xop_readw,
+    xop_storeb,
+    xop_stores,
+    xop_storew,
+
+    xop_add,
+    xop_sub,
+    xop_mul,
+    xop_div,
+    xop_mod,
+    xop_inc,
+    xop_dec,
+
+    xop_gets,
+    xop_saynum,
+    xop_saychar,
+    xop_saystr,
+
+    xop_memcpy,
+    xop_memset,
+    xop_memcmp,
+    xop_memchr,
+
+    xop_call,
+    xop_ret,
+    xop_tailcall,
+    xop_jump,
+    xop_jumprel,
+    xop_jz,
+    xop_jnz,
+    xop_getframe,       /* getlocal and getarg; operand is the entry's */
+    xop_setframe,       /* offset from frame_ptr, see VM_FRAME_ARG */
+
+    /* superinstructions; see vm_decode.c */
+    xop_readb_imm,      /* push <address>; readb */
+    xop_reads_imm,
+    xop_readw_imm,
+    xop_storeb_imm,     /* push <address>; storeb */
+    xop_stores_imm,
+    xop_storew_imm,
+    xop_add_imm,        /* push <value>; add */
+    xop_sub_imm,
+    xop_saychar_imm,    /* push <char>; saychar */
+    xop_saystr_imm,     /* push <address>; saystr */
+    xop_call_imm,       /* push <target>; call */
+    xop_tailcall_imm,   /* push <target>; tailcall */
+    xop_jump_imm,       /* push <target>; jump */
+    xop_jz_imm,         /* push <target>; jz */
+    xop_jnz_imm,        /* push <target>; jnz */
+    xop_dup_jnz_imm,    /* stkdup; push <target>; jnz */
+
+    /* jump8 and the rest; the operand is the target they name */
+    xop_jump_rel,
+    xop_jz_rel,
+    xop_jnz_rel,
+    xop_dup_jnz_rel,    /* stkdup; jnz8 or jnz16 */
+
+    xop_count
+};
+
+struct vm_insn {
+    unsigned char xop;
+    unsigned char length;   /* bytes of bytecode covered by this entry */
+    unsigned short cost;    /* charged to the budget when a backward branch
+                             * or call is taken; see vm_decode.c. A
+                             * tailcall_imm is always charged one, and
+                             * keeps its callee's argument count here. */
+    int operand;
+};
+
+/* The longest run of bytecode a single decoded entry may cover. */
+#define VM_MAX_SPAN         8
+
+
+int vm_decode_init(struct vmstate *vm);
+void vm_decode_free(struct vmstate *vm);
+const struct vm_insn* vm_decode_at(struct vmstate *vm, unsigned address);
+void vm_translate(struct vmstate *vm, unsigned start_address);
+void vm_invalidate(struct vmstate *vm, unsigned address, unsigned size);
+
+/* The length of a push at address, of any encoding, with its constant in
+ * *value, or 0 if there is no complete one there. */
+static inline int vm_push_length(struct vmstate *vm, unsigned address,
+                                 unsigned *value) {
+    const unsigned char *code = &vm->fixed_memory[address];
+    unsigned room = vm->memory_size - address;
+    int length;
+    switch (*code) {
+        case op_push0:  *value = 0;     return 1;
+        case op_push1:  *value = 1;     return 1;
+        case op_pushm1: *value = -1;    return 1;
+        case op_pushnl: *value = '\n';  return 1;
+        case op_pushb:  length = 2; break;
+        case op_pushs:  length = 3; break;
+        case op_pushw:  length = 5; break;
+        case op_pushv: {
+            unsigned shift = 0;
+            *value = 0;
+            for (length = 1; ; ++length) {
+                if ((unsigned)length >= room) {
+                    return 0;
+                }
+                *value |= (code[length] & 0x7Fu) << shift;
+                shift += 7;
+                if (length == 5) {
+                    return 6;
+                } else if (!(code[length] & 0x80)) {
+                    break;
+                }
+            }
+            if (code[length] & 0x40) {
+                *value |= ~0u << shift;
+            }
+            return length + 1;
+        }
+        default:        return 0;
+    }
+    if ((unsigned)length > room) {
+        return 0;
+    }
+    *value = code[1];
+    if (length >= 3) *value |= code[2] << 8;
+    if (length == 5) *value |= code[3] << 16 | (unsigned)code[4] << 24;
+    return length;
+}
+
+/* The length of a jump8, jump16, jz8, jz16, jnz8 or jnz16 at address,
+ * with the address it branches to in *target, or 0 if there is no complete
+ * one there. A target outside memory is left for the caller to find. */
+static inline int vm_branch_length(struct vmstate *vm, unsigned address,
+                                   unsigned *target) {
+    const unsigned char *code = &vm->fixed_memory[address];
+    int length;
+    switch (*code) {
+        case op_jump8:  case op_jz8:    case op_jnz8:   length = 2; break;
+        case op_jump16: case op_jz16:   case op_jnz16:  length = 3; break;
+        default:                                        return 0;
+    }
+    if (length > vm->memory_size - address) {
+        return 0;
+    }
+    int offset = length == 2 ? (int8_t)code[1] : (int16_t)(code[1] | code[2] << 8);
+    *target = address + offset;
+    return length;
+}
+
+/* code_marks bits */
+#define VM_MARK_CODE        1   /* decoded or compiled by the JIT */
+#define VM_MARK_VERIFIED    2   /* part of a function vm_verify accepted */
+
+#ifdef TOYVM_OPCOUNT
+/* the last opcodes a run of vm_run executed; see vm_opcount.c */
+struct vm_opcount_history {
+    unsigned recent;
+    unsigned length;
+};
+void vm_opcount_record(struct vm_opcount_history *history, unsigned xop);
+void vm_opcount_report(FILE *out);
+#endif
+
+/* labels.txt, for naming addresses in profiles; see vm_labels.c */
+struct vm_label {
+    unsigned address;
+    char name[64];
+};
+struct vm_label* vm_labels_load(const char *filename, unsigned *count);
+int vm_labels_find(const struct vm_label *labels, unsigned count, unsigned address);
+
+#ifdef TOYVM_PROFILE
+void vm_profile_resume(struct vmstate *vm);
+void vm_profile_pause(struct vmstate *vm);
+void vm_profile_record(struct vmstate *vm, unsigned address, unsigned xop);
+void vm_profile_report(struct vmstate *vm, FILE *out);
+void vm_profile_free(struct vmstate *vm);
+#endif
+
+/* One byte of vm->dirty per block of memory; see vm_snapshot.c. The array
+ * has a spare entry for a store that runs past the end of memory. */
+#define VM_DIRTY_SHIFT      10
+#define VM_DIRTY_BLOCK      (1u << VM_DIRTY_SHIFT)
+
+static inline void vm_mark_dirty(struct vmstate *vm, unsigned address, unsigned size) {
+    unsigned last = (address + size - 1) >> VM_DIRTY_SHIFT;
+    for (unsigned block = address >> VM_DIRTY_SHIFT; block <= last; ++block) {
+        vm->dirty[block] = 1;
+    }
+}
+
+/* Called for every store of up to four bytes into fixed_memory. code_marks
+ * has a nonzero byte for every address covered by a decoded entry or a
+ * verified function and is padded past the end, so an ordinary data write
+ * costs a single load. A mark just past a short store only costs a call to
+ * vm_invalidate, which checks the exact range. */
+
+static inline void vm_mem_written(struct vmstate *vm, unsigned address, unsigned size) {
+    uint32_t marks;
+    if (address >= vm->memory_size) return;
+    /* size is at most four, so at most two blocks */
+    vm->dirty[address >> VM_DIRTY_SHIFT] = 1;
+    vm->dirty[(address + size - 1) >> VM_DIRTY_SHIFT] = 1;
+    memcpy(&marks, &vm->code_marks[address], sizeof(marks));
+    if (marks) {
+        vm_invalidate(vm, address, size);
+    }
+}
+
+
+/* ************************************************************************* *
+ * STACK HELPERS                                                             *
+ * ************************************************************************* */
+static inline void vm_stk_push(struct vmstate *vm, int value) {
+    *vm->stack_ptr = value;
+    ++vm->stack_ptr;
+}
+static inline int vm_stk_size(struct vmstate *vm) {
+    return vm->stack_ptr - vm->stack;
+}
+static inline int vm_stk_peek(struct vmstate *vm, int pos) {
+    return *(vm->stack_ptr - pos);
+}
+static inline int vm_stk_pop(struct vmstate *vm) {
+    --vm->stack_ptr;
+    return *vm->stack_ptr;
+}
+static inline void vm_stk_set(struct vmstate *vm, int pos, int val) {
+    *(vm->stack_ptr - pos) = val;
+}
+
+/* Only the VM's own thread writes its counters, but vm_get_stats may read
+ * them from another at any time, so every update is an atomic store. On
+ * x86-64 this is the same mov a plain += would be. */
+#define VM_STAT_ADD(field, n) \
+    __atomic_store_n(&(field), (field) + (n), __ATOMIC_RELAXED)
+
+/* vm->stats->max_stack_depth is brought up to date at every call and
+ * whenever the VM stops running */
+static inline void vm_note_depth(struct vmstate *vm) {
+    unsigned depth = vm->stack_ptr - vm->stack;
+    if (depth > vm->stats->max_stack_depth) {
+        __atomic_store_n(&vm->stats->max_stack_depth, depth, __ATOMIC_RELAXED);
+    }
+}
+
+/* A frame on the data stack is the arguments the caller pushed before the
+ * call target, then everything the function pushes; the return address
+ * and the caller's frame are kept apart in a struct vm_frame (see
+ * vm_frames.c). frame_ptr points just past the arguments, so local n is
+ * frame_ptr[n] and argument n, counting back from the one pushed last, is
+ * frame_ptr[VM_FRAME_ARG(n)]. The arguments stay on the caller's stack
+ * after ret, except that a tail call's are moved down over the frame it
+ * replaces; see vm_tail_frame. */
+#define VM_FRAME_ARG(n)     (-1 - (int)(n))
+
+struct vm_frame_record {
+    int32_t func_addr;
+    int32_t ret_addr;
+    int32_t base;
+    int32_t ret_base;
+};
+
+int vm_frames_init(struct vmstate *vm);
+void vm_frames_free(struct vmstate *vm);
+struct vm_frame* vm_frames_grow(struct vmstate *vm);
+void vm_frames_reset(struct vmstate *vm, unsigned start_address);
+struct vm_frame_record* vm_frames_save(struct vmstate *vm, unsigned *count);
+int vm_frames_load(struct vmstate *vm, const struct vm_frame_record *records,
+                   unsigned count);
+void vm_tail_frame(struct vmstate *vm, unsigned function, unsigned args);
+
+/* call: start a new frame for function, to return to return_address.
+ * Returns 0 if calls are already nested as deep as they may go. */
+static inline int vm_push_frame(struct vmstate *vm, unsigned function,
+                                unsigned return_address) {
+    struct vm_frame *frame = vm->call_frame->next;
+    if (!frame && !(frame = vm_frames_grow(vm))) {
+        return 0;
+    }
+    frame->func_addr = function;
+    frame->ret_addr = return_address;
+    frame->base = frame->ret_base = vm->stack_ptr - vm->stack;
+    vm->frame_ptr = vm->stack_ptr;
+    vm->call_frame = frame;
+    VM_STAT_ADD(vm->stats->calls, 1);
+    vm_note_depth(vm);
+    return 1;
+}
+
+/* ret: discard the frame, keeping the value on top, and return the address
+ * to continue at; the outermost frame has nowhere to return to, which
+ * vm_run checks first */
+static inline unsigned vm_pop_frame(struct vmstate *vm) {
+    const struct vm_frame *frame = vm->call_frame;
+    int retval = vm_stk_pop(vm);
+    vm->stack_ptr = vm->stack + frame->ret_base;
+    vm_stk_push(vm, retval);
+    vm->call_frame = frame->prev;
+    vm->frame_ptr = vm->stack + frame->prev->base;
+    VM_STAT_ADD(vm->stats->returns, 1);
+    return frame->ret_addr;
+}
+
+
+/* struct vm_stats; see vm_stats.c */
+int vm_stats_init(struct vmstate *vm);
+void vm_stats_free(struct vmstate *vm);
+
+
+/* ************************************************************************* *
+ * SHARED OPERATIONS                                                         *
+ * ************************************************************************* *
+ * Used by both vm_run and the JIT so the two cannot drift apart.
+ */
+int vm_execute(struct vmstate *vm, unsigned address);
+int vm_execute_verified(struct vmstate *vm, unsigned address);
+void vm_pc_error(struct vmstate *vm, unsigned long address);
+int vm_continue(struct vmstate *vm,
+                int (*run)(struct vmstate *vm, unsigned address));
+void vm_io_gets(struct vmstate *vm, unsigned address, unsigned size);
+void vm_io_saynum(struct vmstate *vm, int value);
+void vm_io_saychar(struct vmstate *vm, int value);
+void vm_io_saystr(struct vmstate *vm, unsigned address);
+int vm_mem_copy(struct vmstate *vm, unsigned dest, unsigned src, unsigned size);
+int vm_mem_fill(struct vmstate *vm, unsigned dest, unsigned value, unsigned size);
+int vm_mem_compare(struct vmstate *vm, unsigned a, unsigned b, unsigned size,
+                   int *result);
+int vm_mem_find(struct vmstate *vm, unsigned address, unsigned value,
+                unsigned size, unsigned *found);
+
+/* vm_stop's flag, read at backward branches and calls */
+static inline int vm_stop_requested(struct vmstate *vm) {
+    return __atomic_load_n(&vm->stop_requested, __ATOMIC_RELAXED);
+}
+
+/* ************************************************************************* *
+ * VERIFIER                                                                  *
+ * ************************************************************************* */
+enum vm_function_status {
+    vm_function_unknown,
+    vm_function_pending,    /* being verified */
+    vm_function_verified,
+    vm_function_rejected
+};
+
+/* one per address in vm->functions; only meaningful at function entries */
+struct vm_function {
+    unsigned short depth;   /* most stack entries the body has above its frame */
+    unsigned char status;
+    unsigned char returns;  /* has a reachable ret, so cannot be run directly */
+    unsigned short args;    /* arguments getarg and setarg use */
+};
+
+int vm_verify_init(struct vmstate *vm);
+void vm_verify_free(struct vmstate *vm);
+void vm_verify_exports(struct vmstate *vm);
+void vm_verify_reset(struct vmstate *vm);
+int vm_verify(struct vmstate *vm, unsigned address);
+
+/* How many arguments a tail call to function moves down over the frame it
+ * replaces, or -1 if vm_verify has not proven function, in which case the
+ * tail call is made as a call; see vm_frames.c. Only looks at what the
+ * verifier has already found. */
+static inline int vm_tail_args(struct vmstate *vm, unsigned function) {
+    if (function >= vm->memory_size || !vm->code_verified
+            || vm->functions[function].status != vm_function_verified) {
+        return -1;
+    }
+    return vm->functions[function].args;
+}
+
+/* ************************************************************************* *
+ * GUARDED MEMORY AND STACK                                                  *
+ * ************************************************************************* */
+int vm_guard_init(struct vmstate *vm, unsigned memory_size,
+                  const unsigned char *memory_source, unsigned stack_size);
+int vm_guard_init_file(struct vmstate *vm, const char *filename,
+                       unsigned stack_size);
+int vm_guard_init_fd(struct vmstate *vm, int fd, off_t offset,
+                     unsigned memory_size, unsigned stack_size);
+int vm_guard_stack(struct vmstate *vm, unsigned stack_size);
+size_t vm_guard_stack_area(struct vmstate *vm, unsigned char **start);
+int vm_guard_map_stack(struct vmstate *vm, int fd, off_t offset);
+void vm_guard_free(struct vmstate *vm);
+int vm_guarded_run(struct vmstate *vm,
+                   int (*run)(struct vmstate *vm, unsigned address),
+                   unsigned address);
+struct vmstate* vm_guard_current(void);
+
+/* ************************************************************************* *
+ * SHARED IMAGES                                                             *
+ * ************************************************************************* */
+int vm_image_map_memory(struct vmstate *vm, const struct vm_image *image);
+int vm_image_map_state(struct vmstate *vm, const struct vm_image *image);
+void vm_image_unmap_state(struct vmstate *vm);
+int vm_write_all(int fd, const void *data, size_t length, off_t offset);
+int vm_write_sparse(int fd, const void *data, size_t length, off_t offset);
+
+/* ************************************************************************* *
+ * SNAPSHOTS                                                                 *
+ * ************************************************************************* */
+int vm_snapshot_map(struct vmstate *vm, const char *filename,
+                    struct vm_frame_record **frames, unsigned *frame_count);
+int vm_dirty_init(struct vmstate *vm);
+void vm_dirty_free(struct vmstate *vm);
+
+int vm_jit_init(struct vmstate *vm);
+void vm_jit_free(struct vmstate *vm);
+void vm_jit_code_written(struct vmstate *vm);
+
+#endif
@@ -0,0 +1,813 @@
+#define _DEFAULT_SOURCE
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "toyvm.h"
+#include "opcode.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * BASELINE JIT                                                              *
+ * ************************************************************************* *
+ * vm_run_jit translates bytecode into x86-64 machine code one opcode
+ * template at a time, a block at a time, starting from the address it is
+ * asked to run. Blocks run until they reach an instruction they leave to C
+ * (call, ret, tailcall, exit and the I/O opcodes) or a branch to code that has not
+ * been compiled yet, and then return to the driver loop below. Anything the
+ * JIT does not understand, and any program that writes over code it has
+ * compiled, continues in the interpreter from that point on.
+ *
+ * Inside compiled code:
+ *      rbx     struct vmstate *
+ *      rbp     instructions executed, not yet added to vm->stats
+ *      r12     VM stack pointer (int *)
+ *      r13     fixed_memory
+ *      r14     VM stack base, for underflow checks
+ *      r15     end of the VM stack, for overflow checks
+ */
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+#define JIT_BUFFER_SIZE     (1024 * 1024)
+#define JIT_MAX_BLOCK       1024
+#define JIT_MAX_FIXUPS      256
+/* room for the largest opcode template plus its exit stub */
+#define JIT_HEADROOM        128
+/* room for what resolving one fixup may add: a stop check and an exit */
+#define JIT_FIXUP_ROOM      48
+
+enum jit_exit {
+    exit_branch,         /* continue at pc */
+    exit_helper,         /* execute the instruction at pc in C */
+    exit_underflow,      /* stack underflow */
+    exit_overflow,       /* stack overflow */
+    exit_modified        /* compiled code was written to; pc is the next one */
+};
+
+/* A jump out of the current block, resolved once the block is done: to
+ * compiled code for target if there is any, or to an exit. */
+struct jit_fixup {
+    unsigned char *site;    /* the rel32 to patch */
+    enum jit_exit reason;
+    unsigned target;        /* bytecode address it should reach or report */
+};
+
+struct vm_jit {
+    unsigned char *buffer;
+    unsigned char *cursor;
+    unsigned char *epilogue;
+    struct jit_fixup fixups[JIT_MAX_FIXUPS];
+    int fixup_count;
+    void **entries;         /* native code for each bytecode address */
+    unsigned char modified;
+    int disabled;
+};
+
+typedef uint64_t (*jit_entry_fn)(struct vmstate *vm, void *code);
+typedef void (*jit_store_fn)(struct vmstate *vm, unsigned address, unsigned value);
+
+
+/* ************************************************************************* *
+ * CODE EMISSION                                                             *
+ * ************************************************************************* */
+static void emit(struct vm_jit *jit, const char *bytes, int count) {
+    memcpy(jit->cursor, bytes, count);
+    jit->cursor += count;
+}
+
+static void emit8(struct vm_jit *jit, unsigned value) {
+    *jit->cursor++ = value;
+}
+
+static void emit32(struct vm_jit *jit, uint32_t value) {
+    memcpy(jit->cursor, &value, 4);
+    jit->cursor += 4;
+}
+
+static void emit64(struct vm_jit *jit, uint64_t value) {
+    memcpy(jit->cursor, &value, 8);
+    jit->cursor += 8;
+}
+
+static void patch_rel32(unsigned char *site, const unsigned char *target) {
+    int32_t rel = target - (site + 4);
+    memcpy(site, &rel, 4);
+}
+
+/* jmp/jcc with a rel32 operand; returns the operand's address */
+static unsigned char* emit_jump(struct vm_jit *jit, const char *opcode, int length,
+                                const unsigned char *target) {
+    emit(jit, opcode, length);
+    unsigned char *site = jit->cursor;
+    emit32(jit, 0);
+    if (target) {
+        patch_rel32(site, target);
+    }
+    return site;
+}
+
+/* mov edx, pc; mov eax, reason; jmp epilogue */
+static void emit_exit(struct vm_jit *jit, enum jit_exit reason, unsigned pc) {
+    emit8(jit, 0xBA);
+    emit32(jit, pc);
+    emit8(jit, 0xB8);
+    emit32(jit, reason);
+    emit_jump(jit, "\xE9", 1, jit->epilogue);
+}
+
+/* jmp or jcc rel32 to be resolved by resolve_fixups */
+static void emit_fixup(struct vm_jit *jit, const char *opcode,
+                       enum jit_exit reason, unsigned target) {
+    struct jit_fixup *fixup = &jit->fixups[jit->fixup_count++];
+    fixup->site = emit_jump(jit, opcode, strlen(opcode), NULL);
+    fixup->reason = reason;
+    fixup->target = target;
+}
+
+/* lea rax, [r14 + count*4]; cmp r12, rax; jb underflow */
+static void emit_min_stack(struct vm_jit *jit, int count, unsigned pc) {
+    emit(jit, "\x49\x8D\x46", 3);
+    emit8(jit, count * 4);
+    emit(jit, "\x49\x39\xC4", 3);
+    emit_fixup(jit, "\x0F\x82", exit_underflow, pc);
+}
+
+/* lea rax, [r12 + count*4]; cmp rax, r15; ja overflow */
+static void emit_max_stack(struct vm_jit *jit, int count, unsigned pc) {
+    emit(jit, "\x49\x8D\x44\x24", 4);
+    emit8(jit, count * 4);
+    emit(jit, "\x4C\x39\xF8", 3);
+    emit_fixup(jit, "\x0F\x87", exit_overflow, pc);
+}
+
+/* mov dword [rbx+pc], pc; for vm_guard.c to report a fault */
+static void emit_fault_pc(struct vm_jit *jit, unsigned pc) {
+    emit(jit, "\xC7\x83", 2);
+    emit32(jit, offsetof(struct vmstate, pc));
+    emit32(jit, pc);
+}
+
+/* mov rdi, rbx; mov rax, function; call rax */
+static void emit_call(struct vm_jit *jit, jit_store_fn function) {
+    emit(jit, "\x48\x89\xDF", 3);
+    emit(jit, "\x48\xB8", 2);
+    emit64(jit, (uintptr_t)function);
+    emit(jit, "\xFF\xD0", 2);
+}
+
+/* mov rcx, [rbx+stats]; add qword [rcx+counter], value */
+static void emit_count(struct vm_jit *jit, size_t counter, unsigned value) {
+    emit(jit, "\x48\x8B\x8B", 3);
+    emit32(jit, offsetof(struct vmstate, stats));
+    emit(jit, "\x48\x83\x81", 3);
+    emit32(jit, counter);
+    emit8(jit, value);
+}
+
+/* mov rcx, [rbx+stats]; add [rcx+instructions], rbp; xor ebp, ebp */
+static void emit_flush_retired(struct vm_jit *jit) {
+    emit(jit, "\x48\x8B\x8B", 3);
+    emit32(jit, offsetof(struct vmstate, stats));
+    emit(jit, "\x48\x01\xA9", 3);
+    emit32(jit, offsetof(struct vm_stats, instructions));
+    emit(jit, "\x31\xED", 2);
+}
+
+/* the instruction count goes into vm->stats; cmp dword [rbx+stop_requested],
+ * 0; je target; then an exit to the driver, which sees the flag */
+static void emit_stop_check(struct vm_jit *jit, const unsigned char *target,
+                            unsigned pc) {
+    emit_flush_retired(jit);
+    emit(jit, "\x83\xBB", 2);
+    emit32(jit, offsetof(struct vmstate, stop_requested));
+    emit8(jit, 0);
+    emit_jump(jit, "\x0F\x84", 2, target);
+    emit_exit(jit, exit_branch, pc);
+}
+
+static void emit_trampoline(struct vm_jit *jit) {
+    emit(jit, "\x53\x55\x41\x54\x41\x55\x41\x56\x41\x57", 10); /* push rbx, rbp, r12-r15 */
+    emit(jit, "\x48\x83\xEC\x08", 4);                   /* sub rsp, 8 */
+    emit(jit, "\x48\x89\xFB", 3);                       /* mov rbx, rdi */
+    emit(jit, "\x31\xED", 2);                           /* xor ebp, ebp */
+    emit(jit, "\x4C\x8B\xA3", 3);                       /* mov r12, [rbx+stack_ptr] */
+    emit32(jit, offsetof(struct vmstate, stack_ptr));
+    emit(jit, "\x4C\x8B\xAB", 3);                       /* mov r13, [rbx+fixed_memory] */
+    emit32(jit, offsetof(struct vmstate, fixed_memory));
+    emit(jit, "\x4C\x8B\xB3", 3);                       /* mov r14, [rbx+stack] */
+    emit32(jit, offsetof(struct vmstate, stack));
+    emit(jit, "\x8B\x83", 2);                           /* mov eax, [rbx+stack_size] */
+    emit32(jit, offsetof(struct vmstate, stack_size));
+    emit(jit, "\x48\x83\xE0\xFC", 4);                   /* and rax, ~3 */
+    emit(jit, "\x4D\x8D\x3C\x06", 4);                   /* lea r15, [r14+rax] */
+    emit(jit, "\xFF\xE6", 2);                           /* jmp rsi */
+
+    jit->epilogue = jit->cursor;
+    emit(jit, "\x4C\x89\xA3", 3);                       /* mov [rbx+stack_ptr], r12 */
+    emit32(jit, offsetof(struct vmstate, stack_ptr));
+    emit_flush_retired(jit);
+    emit(jit, "\x48\xC1\xE0\x20", 4);                   /* shl rax, 32 */
+    emit(jit, "\x89\xD2", 2);                           /* mov edx, edx */
+    emit(jit, "\x48\x09\xD0", 3);                       /* or rax, rdx */
+    emit(jit, "\x48\x83\xC4\x08", 4);                   /* add rsp, 8 */
+    emit(jit, "\x41\x5F\x41\x5E\x41\x5D\x41\x5C\x5D\x5B", 10); /* pop r15-r12, rbp, rbx */
+    emit8(jit, 0xC3);                                   /* ret */
+}
+
+
+/* ************************************************************************* *
+ * COMPILER                                                                  *
+ * ************************************************************************* */
+static void mark_code(struct vmstate *vm, unsigned pc, int length) {
+    for (int i = 0; i < length; ++i) {
+        vm->code_marks[pc + i] |= VM_MARK_CODE;
+    }
+}
+
+static void* jit_compile(struct vmstate *vm, unsigned start) {
+    struct vm_jit *jit = vm->jit;
+    unsigned pc = start;
+    unsigned value;
+
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0) {
+        return NULL;
+    }
+    unsigned char *limit = jit->buffer + JIT_BUFFER_SIZE
+                         - JIT_HEADROOM - JIT_MAX_FIXUPS * JIT_FIXUP_ROOM;
+    if (jit->cursor >= limit) {
+        mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC);
+        return NULL;
+    }
+
+    for (int count = 0; ; ++count) {
+        if (pc >= vm->memory_size) {
+            emit_exit(jit, exit_branch, pc);
+            break;
+        }
+        if (jit->entries[pc]) {
+            emit_jump(jit, "\xE9", 1, jit->entries[pc]);
+            break;
+        }
+        if (count >= JIT_MAX_BLOCK || jit->cursor >= limit
+                || jit->fixup_count > JIT_MAX_FIXUPS - 3) {
+            emit_exit(jit, exit_branch, pc);
+            break;
+        }
+
+        unsigned opcode = vm->fixed_memory[pc];
+        int length = vm_push_length(vm, pc, &value);
+        int ends_block = 0;
+        int retired = 1;
+        jit->entries[pc] = jit->cursor;
+        /* add rbp, retired; patched below for fused instructions */
+        emit(jit, "\x48\x83\xC5\x01", 4);
+        unsigned char *retired_site = jit->cursor - 1;
+
+        if (length > 0) {
+            unsigned next = pc + length;
+            unsigned next_op = next < vm->memory_size ? vm->fixed_memory[next] : op_bad;
+            if ((next_op == op_jz || next_op == op_jnz) && value < vm->memory_size) {
+                /* push <target>; jz or jnz */
+                emit_min_stack(jit, 1, next);
+                emit(jit, "\x49\x83\xEC\x04", 4);               /* sub r12, 4 */
+                emit(jit, "\x41\x8B\x04\x24", 4);               /* mov eax, [r12] */
+                emit(jit, "\x85\xC0", 2);                       /* test eax, eax */
+                emit_fixup(jit, next_op == op_jnz ? "\x0F\x85" : "\x0F\x84",
+                           exit_branch, value);
+                ++length;
+                retired = 2;
+            } else if (next_op == op_jump && value < vm->memory_size) {
+                /* push <target>; jump */
+                emit_fixup(jit, "\xE9", exit_branch, value);
+                ++length;
+                retired = 2;
+                ends_block = 1;
+            } else {
+                emit_max_stack(jit, 1, pc);
+                emit(jit, "\x41\xC7\x04\x24", 4);               /* mov dword [r12], value */
+                emit32(jit, value);
+                emit(jit, "\x49\x83\xC4\x04", 4);               /* add r12, 4 */
+            }
+        } else {
+            length = 1;
+            switch (opcode) {
+                case op_stkdup: {
+                    unsigned next = pc + 1;
+                    int push_length = next < vm->memory_size
+                                    ? vm_push_length(vm, next, &value) : 0;
+                    next += push_length;
+                    int branch_length = next < vm->memory_size && !push_length
+                                      ? vm_branch_length(vm, next, &value) : 0;
+                    unsigned branch_op = branch_length ? vm->fixed_memory[next] : op_bad;
+                    emit_min_stack(jit, 1, pc);
+                    if (push_length > 0 && next < vm->memory_size
+                            && vm->fixed_memory[next] == op_jnz
+                            && value < vm->memory_size) {
+                        /* stkdup; push <target>; jnz */
+                        emit(jit, "\x41\x83\x7C\x24\xFC\x00", 6); /* cmp dword [r12-4], 0 */
+                        emit_fixup(jit, "\x0F\x85", exit_branch, value);
+                        length += push_length + 1;
+                        retired = 3;
+                    } else if (branch_op == op_jnz8 || branch_op == op_jnz16) {
+                        /* stkdup; jnz8 or jnz16 */
+                        emit(jit, "\x41\x83\x7C\x24\xFC\x00", 6); /* cmp dword [r12-4], 0 */
+                        emit_fixup(jit, "\x0F\x85", exit_branch, value);
+                        length += branch_length;
+                        retired = 2;
+                    } else {
+                        emit_max_stack(jit, 1, pc);
+                        emit(jit, "\x41\x8B\x44\x24\xFC", 5);   /* mov eax, [r12-4] */
+                        emit(jit, "\x41\x89\x04\x24", 4);       /* mov [r12], eax */
+                        emit(jit, "\x49\x83\xC4\x04", 4);       /* add r12, 4 */
+                    }
+                    break; }
+
+                case op_readb:
+                case op_reads:
+                case op_readw:
+                    emit_min_stack(jit, 1, pc);
+                    emit_fault_pc(jit, pc);
+                    emit_count(jit, offsetof(struct vm_stats, bytes_read),
+                               opcode == op_readb ? 1 : opcode == op_reads ? 2 : 4);
+                    emit(jit, "\x41\x8B\x44\x24\xFC", 5);       /* mov eax, [r12-4] */
+                    if (opcode == op_readb) {
+                        emit(jit, "\x41\x0F\xB6\x44\x05\x00", 6); /* movzx eax, byte [r13+rax] */
+                    } else if (opcode == op_reads) {
+                        emit(jit, "\x41\x0F\xB7\x44\x05\x00", 6); /* movzx eax, word [r13+rax] */
+                    } else {
+                        emit(jit, "\x41\x8B\x44\x05\x00", 5);   /* mov eax, [r13+rax] */
+                    }
+                    emit(jit, "\x41\x89\x44\x24\xFC", 5);       /* mov [r12-4], eax */
+                    break;
+
+                case op_storeb:
+                case op_stores:
+                case op_storew: {
+                    emit_min_stack(jit, 2, pc);
+                    emit_fault_pc(jit, pc);
+                    emit_count(jit, offsetof(struct vm_stats, bytes_written),
+                               opcode == op_storeb ? 1 : opcode == op_stores ? 2 : 4);
+                    emit(jit, "\x41\x8B\x74\x24\xFC", 5);       /* mov esi, [r12-4] */
+                    emit(jit, "\x41\x8B\x54\x24\xF8", 5);       /* mov edx, [r12-8] */
+                    emit(jit, "\x49\x83\xEC\x08", 4);           /* sub r12, 8 */
+                    emit_call(jit, opcode == op_storeb ? vm_store_byte
+                                 : opcode == op_stores ? vm_store_short
+                                 : vm_store_word);
+                    emit(jit, "\x48\xB8", 2);                   /* mov rax, &modified */
+                    emit64(jit, (uintptr_t)&jit->modified);
+                    emit(jit, "\x80\x38\x00", 3);               /* cmp byte [rax], 0 */
+                    unsigned char *skip = emit_jump(jit, "\x0F\x84", 2, NULL);
+                    emit_exit(jit, exit_modified, pc + 1);
+                    patch_rel32(skip, jit->cursor);
+                    break; }
+
+                case op_add:
+                case op_sub:
+                    emit_min_stack(jit, 2, pc);
+                    emit(jit, "\x41\x8B\x44\x24\xFC", 5);       /* mov eax, [r12-4] */
+                    emit(jit, "\x49\x83\xEC\x04", 4);           /* sub r12, 4 */
+                    if (opcode == op_add) {
+                        emit(jit, "\x41\x01\x44\x24\xFC", 5);   /* add [r12-4], eax */
+                    } else {
+                        emit(jit, "\x41\x29\x44\x24\xFC", 5);   /* sub [r12-4], eax */
+                    }
+                    break;
+                case op_mul:
+                    emit_min_stack(jit, 2, pc);
+                    emit(jit, "\x41\x8B\x44\x24\xFC", 5);       /* mov eax, [r12-4] */
+                    emit(jit, "\x49\x83\xEC\x04", 4);           /* sub r12, 4 */
+                    emit(jit, "\x41\x8B\x4C\x24\xFC", 5);       /* mov ecx, [r12-4] */
+                    emit(jit, "\x0F\xAF\xC8", 3);               /* imul ecx, eax */
+                    emit(jit, "\x41\x89\x4C\x24\xFC", 5);       /* mov [r12-4], ecx */
+                    break;
+                case op_div:
+                case op_mod:
+                    emit_min_stack(jit, 2, pc);
+                    emit(jit, "\x41\x8B\x4C\x24\xFC", 5);       /* mov ecx, [r12-4] */
+                    emit(jit, "\x49\x83\xEC\x04", 4);           /* sub r12, 4 */
+                    emit(jit, "\x41\x8B\x44\x24\xFC", 5);       /* mov eax, [r12-4] */
+                    emit(jit, "\x99\xF7\xF9", 3);               /* cdq; idiv ecx */
+                    if (opcode == op_div) {
+                        emit(jit, "\x41\x89\x44\x24\xFC", 5);   /* mov [r12-4], eax */
+                    } else {
+                        emit(jit, "\x41\x89\x54\x24\xFC", 5);   /* mov [r12-4], edx */
+                    }
+                    break;
+                case op_inc:
+                    emit_min_stack(jit, 1, pc);
+                    emit(jit, "\x41\x83\x44\x24\xFC\x01", 6);   /* add dword [r12-4], 1 */
+                    break;
+                case op_dec:
+                    emit_min_stack(jit, 1, pc);
+                    emit(jit, "\x41\x83\x6C\x24\xFC\x01", 6);   /* sub dword [r12-4], 1 */
+                    break;
+
+                case op_jump:
+                case op_jumprel:
+                    emit_min_stack(jit, 1, pc);
+                    emit(jit, "\x41\x8B\x54\x24\xFC", 5);       /* mov edx, [r12-4] */
+                    emit(jit, "\x49\x83\xEC\x04", 4);           /* sub r12, 4 */
+                    if (opcode == op_jumprel) {
+                        emit(jit, "\x81\xC2", 2);               /* add edx, pc */
+                        emit32(jit, pc);
+                    }
+                    emit8(jit, 0xB8);                           /* mov eax, exit_branch */
+                    emit32(jit, exit_branch);
+                    emit_jump(jit, "\xE9", 1, jit->epilogue);
+                    ends_block = 1;
+                    break;
+
+                case op_jz:
+                case op_jnz: {
+                    emit_min_stack(jit, 2, pc);
+                    emit(jit, "\x41\x8B\x44\x24\xF8", 5);       /* mov eax, [r12-8] */
+                    emit(jit, "\x41\x8B\x54\x24\xFC", 5);       /* mov edx, [r12-4] */
+                    emit(jit, "\x49\x83\xEC\x08", 4);           /* sub r12, 8 */
+                    emit(jit, "\x85\xC0", 2);                   /* test eax, eax */
+                    unsigned char *skip = emit_jump(jit, opcode == op_jnz ? "\x0F\x84"
+                                                                       : "\x0F\x85", 2, NULL);
+                    emit8(jit, 0xB8);                           /* mov eax, exit_branch */
+                    emit32(jit, exit_branch);
+                    emit_jump(jit, "\xE9", 1, jit->epilogue);
+                    patch_rel32(skip, jit->cursor);
+                    break; }
+
+                case op_jump8:
+                case op_jump16:
+                case op_jz8:
+                case op_jz16:
+                case op_jnz8:
+                case op_jnz16:
+                    length = vm_branch_length(vm, pc, &value);
+                    if (!length) {
+                        /* the interpreter reports the missing operand */
+                        emit_exit(jit, exit_helper, pc);
+                        ends_block = 1;
+                        retired = 0;
+                        length = 1;
+                        break;
+                    }
+                    if (opcode == op_jump8 || opcode == op_jump16) {
+                        emit_fixup(jit, "\xE9", exit_branch, value);
+                        ends_block = 1;
+                        break;
+                    }
+                    emit_min_stack(jit, 1, pc);
+                    emit(jit, "\x49\x83\xEC\x04", 4);           /* sub r12, 4 */
+                    emit(jit, "\x41\x8B\x04\x24", 4);           /* mov eax, [r12] */
+                    emit(jit, "\x85\xC0", 2);                   /* test eax, eax */
+                    emit_fixup(jit, opcode == op_jnz8 || opcode == op_jnz16 ? "\x0F\x85"
+                                                                          : "\x0F\x84",
+                               exit_branch, value);
+                    break;
+
+                case op_getlocal:
+                case op_setlocal:
+                case op_getarg:
+                case op_setarg: {
+                    if (pc + 1 >= vm->memory_size) {
+                        /* the interpreter reports the missing operand */
+                        emit_exit(jit, exit_helper, pc);
+                        ends_block = 1;
+                        retired = 0;
+                        break;
+                    }
+                    unsigned number = vm->fixed_memory[pc + 1];
+                    int slot = opcode == op_getlocal || opcode == op_setlocal
+                             ? (int)number : VM_FRAME_ARG(number);
+                    int get = opcode == op_getlocal || opcode == op_getarg;
+                    length = 2;
+                    if (get) {
+                        emit_max_stack(jit, 1, pc);
+                    } else {
+                        emit_min_stack(jit, 1, pc);
+                    }
+                    emit(jit, "\x48\x8B\x83", 3);               /* mov rax, [rbx+frame_ptr] */
+                    emit32(jit, offsetof(struct vmstate, frame_ptr));
+                    emit(jit, "\x48\x8D\x80", 3);               /* lea rax, [rax + slot*4] */
+                    emit32(jit, slot * 4);
+                    emit(jit, "\x4C\x39\xF0", 3);               /* cmp rax, r14 */
+                    emit_fixup(jit, "\x0F\x82", exit_underflow, pc);
+                    if (get) {
+                        emit(jit, "\x4C\x39\xE0", 3);           /* cmp rax, r12 */
+                        emit_fixup(jit, "\x0F\x83", exit_underflow, pc);
+                        emit(jit, "\x8B\x00", 2);                /* mov eax, [rax] */
+                        emit(jit, "\x41\x89\x04\x24", 4);       /* mov [r12], eax */
+                        emit(jit, "\x49\x83\xC4\x04", 4);       /* add r12, 4 */
+                    } else {
+                        emit(jit, "\x49\x8D\x4C\x24\xFC", 5);   /* lea rcx, [r12-4] */
+                        emit(jit, "\x48\x39\xC8", 3);           /* cmp rax, rcx */
+                        emit_fixup(jit, "\x0F\x83", exit_underflow, pc);
+                        emit(jit, "\x41\x8B\x4C\x24\xFC", 5);   /* mov ecx, [r12-4] */
+                        emit(jit, "\x89\x08", 2);                /* mov [rax], ecx */
+                        emit(jit, "\x49\x83\xEC\x04", 4);       /* sub r12, 4 */
+                    }
+                    break; }
+
+                default:
+                    /* calls, ret, exit, I/O and anything unknown; jit_helper
+                     * counts the ones it runs */
+                    emit_exit(jit, exit_helper, pc);
+                    ends_block = 1;
+                    retired = 0;
+                    break;
+            }
+        }
+
+        *retired_site = retired;
+        mark_code(vm, pc, length);
+        pc += length;
+        if (ends_block) {
+            break;
+        }
+    }
+
+    for (int i = 0; i < jit->fixup_count; ++i) {
+        struct jit_fixup *fixup = &jit->fixups[i];
+        void *target = NULL;
+        if (fixup->reason == exit_branch && fixup->target < vm->memory_size) {
+            target = jit->entries[fixup->target];
+        }
+        if (!target) {
+            target = jit->cursor;
+            emit_exit(jit, fixup->reason, fixup->target);
+        } else if ((unsigned char*)target < fixup->site) {
+            /* every loop in compiled code goes through a jump like this */
+            unsigned char *check = jit->cursor;
+            emit_stop_check(jit, target, fixup->target);
+            target = check;
+        }
+        patch_rel32(fixup->site, target);
+    }
+    jit->fixup_count = 0;
+
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        jit->disabled = 1;
+        return NULL;
+    }
+    return jit->entries[start];
+}
+
+
+/* ************************************************************************* *
+ * DRIVER                                                                    *
+ * ************************************************************************* */
+int vm_jit_init(struct vmstate *vm) {
+    struct vm_jit *jit = calloc(1, sizeof(struct vm_jit));
+    if (!jit) return 0;
+
+    jit->entries = calloc(vm->memory_size, sizeof(void*));
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (!jit->entries || jit->buffer == MAP_FAILED) {
+        if (jit->buffer != MAP_FAILED) munmap(jit->buffer, JIT_BUFFER_SIZE);
+        free(jit->entries);
+        free(jit);
+        return 0;
+    }
+    jit->cursor = jit->buffer;
+    emit_trampoline(jit);
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0) {
+        munmap(jit->buffer, JIT_BUFFER_SIZE);
+        free(jit->entries);
+        free(jit);
+        return 0;
+    }
+    vm->jit = jit;
+    return 1;
+}
+
+void vm_jit_free(struct vmstate *vm) {
+    struct vm_jit *jit = vm->jit;
+    if (!jit) return;
+    munmap(jit->buffer, JIT_BUFFER_SIZE);
+    free(jit->entries);
+    free(jit);
+    vm->jit = NULL;
+}
+
+void vm_jit_code_written(struct vmstate *vm) {
+    vm->jit->modified = 1;
+}
+
+static uint64_t jit_enter(struct vmstate *vm, void *code) {
+    union { void *address; jit_entry_fn function; } trampoline;
+    trampoline.address = vm->jit->buffer;
+    return trampoline.function(vm, code);
+}
+
+/* Runs the instruction at *pc that compiled code handed back. Returns 1 to
+ * keep going at *pc, 0 when the run is over with *result (finished, or
+ * waiting for input), or -1 when the instruction is one the interpreter
+ * has to deal with. */
+static int jit_helper(struct vmstate *vm, unsigned *pc, int *result) {
+    unsigned address, size, value;
+    int min_stack, args;
+
+    switch (vm->fixed_memory[*pc]) {
+        case op_exit:
+            VM_STAT_ADD(vm->stats->instructions, 1);
+            *result = 1;
+            return 0;
+        case op_call:
+        case op_ret:
+        case op_tailcall:
+        case op_saynum:
+        case op_saychar:
+        case op_saystr:
+            min_stack = 1;
+            break;
+        case op_gets:
+            min_stack = 0;
+            break;
+        case op_memcpy:
+        case op_memset:
+        case op_memcmp:
+        case op_memchr:
+            min_stack = 3;
+            break;
+        default:
+            return -1;
+    }
+    if (vm_stk_size(vm) < min_stack) {
+        fprintf(stderr, "stack underflow\n");
+        *result = 0;
+        return 0;
+    }
+
+    switch (vm->fixed_memory[*pc]) {
+        case op_call:
+            address = vm_stk_pop(vm);
+            if (!vm_push_frame(vm, address, *pc + 1)) {
+                fprintf(stderr, "Instruction at 0x%08X overflowed the call stack.\n", *pc);
+                *result = 0;
+                return 0;
+            }
+            VM_STAT_ADD(vm->stats->instructions, 1);
+            *pc = vm->pc = address;     /* for vm_sample.c */
+            return 1;
+        case op_ret:
+            if (!vm->call_frame->prev) {
+                fprintf(stderr, "Instruction at 0x%08X returned with no call to return from.\n",
+                        *pc);
+                *result = 0;
+                return 0;
+            }
+            VM_STAT_ADD(vm->stats->instructions, 1);
+            *pc = vm->pc = vm_pop_frame(vm);
+            return 1;
+        case op_tailcall:
+            address = vm_stk_pop(vm);
+            args = vm_tail_args(vm, address);
+            if (args >= 0) {
+                vm_tail_frame(vm, address, args);
+            } else if (!vm_push_frame(vm, address, *pc + 1)) {
+                /* not proven, so a call back to the ret after this */
+                fprintf(stderr, "Instruction at 0x%08X overflowed the call stack.\n", *pc);
+                *result = 0;
+                return 0;
+            }
+            VM_STAT_ADD(vm->stats->instructions, 1);
+            *pc = vm->pc = address;
+            return 1;
+        case op_gets:
+            if (!vm_input_ready(vm)) {
+                vm->resume_pc = *pc;
+                vm->resume_verified = 0;
+                *result = vm_status_waiting;
+                return 0;
+            }
+            address = vm_stk_pop(vm);
+            size = vm_stk_pop(vm);
+            vm_io_gets(vm, address, size);
+            break;
+        case op_saynum:
+            vm_io_saynum(vm, vm_stk_pop(vm));
+            break;
+        case op_saychar:
+            vm_io_saychar(vm, vm_stk_pop(vm));
+            break;
+        case op_saystr:
+            vm_io_saystr(vm, vm_stk_pop(vm));
+            break;
+        case op_memcpy:
+        case op_memset:
+        case op_memcmp:
+        case op_memchr: {
+            unsigned opcode = vm->fixed_memory[*pc];
+            size = vm_stk_pop(vm);
+            value = vm_stk_pop(vm);
+            address = vm_stk_pop(vm);
+            vm->pc = *pc;
+            int ok, order;
+            switch (opcode) {
+                case op_memcpy:
+                    ok = vm_mem_copy(vm, address, value, size);
+                    break;
+                case op_memset:
+                    ok = vm_mem_fill(vm, address, value, size);
+                    break;
+                case op_memcmp:
+                    ok = vm_mem_compare(vm, address, value, size, &order);
+                    vm_stk_push(vm, order);
+                    break;
+                default:
+                    ok = vm_mem_find(vm, address, value, size, &address);
+                    vm_stk_push(vm, address);
+                    break;
+            }
+            if (!ok) {
+                *result = 0;
+                return 0;
+            }
+            break; }
+    }
+    VM_STAT_ADD(vm->stats->instructions, 1);
+    ++*pc;
+    return 1;
+}
+
+static int jit_run(struct vmstate *vm, unsigned start_address) {
+    struct vm_jit *jit = vm->jit;
+    unsigned pc = start_address;
+    int result = 0;
+
+    while (1) {
+        if (pc >= vm->memory_size) {
+            vm_pc_error(vm, pc);
+            return 0;
+        }
+        if (vm_stop_requested(vm)) {
+            vm->resume_pc = pc;
+            vm->resume_verified = 0;
+            return vm_status_stopped;
+        }
+        if (jit->modified || jit->disabled) {
+            jit->disabled = 1;
+            return vm_execute(vm, pc);
+        }
+
+        void *code = jit->entries[pc];
+        if (!code) {
+            code = jit_compile(vm, pc);
+            if (!code) {
+                return vm_execute(vm, pc);
+            }
+        }
+
+        uint64_t exit = jit_enter(vm, code);
+        pc = (uint32_t)exit;
+        switch ((enum jit_exit)(exit >> 32)) {
+            case exit_branch:
+            case exit_modified:
+                break;
+            case exit_underflow:
+                fprintf(stderr, "stack underflow\n");
+                return 0;
+            case exit_overflow:
+                fprintf(stderr, "Instruction at 0x%08X overflowed the stack.\n", pc);
+                return 0;
+            case exit_helper:
+                switch (jit_helper(vm, &pc, &result)) {
+                    case 0:     return result;
+                    case -1:    return vm_execute(vm, pc);
+                }
+                break;
+        }
+    }
+}
+
+int vm_run_jit(struct vmstate *vm, unsigned start_address) {
+    if (start_address >= vm->memory_size) {
+        return 0;
+    }
+    if (!vm->jit && !vm_jit_init(vm)) {
+        return vm_run(vm, start_address);
+    }
+    vm_start(vm, start_address);
+    vm->budget = LONG_MAX;
+    return vm_continue(vm, jit_run) == vm_status_exited;
+}
+
+#else
+
+int vm_jit_init(struct vmstate *vm) {
+    return 0;
+}
+
+void vm_jit_free(struct vmstate *vm) {
+}
+
+void vm_jit_code_written(struct vmstate *vm) {
+}
+
+int vm_run_jit(struct vmstate *vm, unsigned start_address) {
+    return vm_run(vm, start_address);
+}
+
+#endif
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * LABELS                                                                    *
+ * ************************************************************************* *
+ * The profilers name addresses after the labels in the labels.txt the
+ * assembler writes, taking the nearest label at or before each address.
+ */
+
+static int compare_labels(const void *a, const void *b) {
+    const struct vm_label *left = a, *right = b;
+    return left->address < right->address ? -1 : left->address > right->address;
+}
+
+/* Returns the labels sorted by address, or NULL (with *count 0) if the file
+ * cannot be read. */
+struct vm_label* vm_labels_load(const char *filename, unsigned *count) {
+    FILE *in = fopen(filename, "rt");
+    struct vm_label *labels = NULL, label;
+    unsigned capacity = 0;
+    *count = 0;
+    if (!in) {
+        return NULL;
+    }
+    while (fscanf(in, "%x %63s", &label.address, label.name) == 2) {
+        if (*count == capacity) {
+            capacity = capacity ? capacity * 2 : 64;
+            struct vm_label *new_labels = realloc(labels, capacity * sizeof(label));
+            if (!new_labels) break;
+            labels = new_labels;
+        }
+        labels[(*count)++] = label;
+    }
+    fclose(in);
+    if (*count > 0) {
+        qsort(labels, *count, sizeof(struct vm_label), compare_labels);
+    }
+    return labels;
+}
+
+/* The label at or before address, or -1. */
+int vm_labels_find(const struct vm_label *labels, unsigned count, unsigned address) {
+    int low = 0, high = (int)count - 1, found = -1;
+    while (low <= high) {
+        int middle = (low + high) / 2;
+        if (labels[middle].address <= address) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * OPCODE SEQUENCE COUNTING                                                  *
+ * ************************************************************************* *
+ * Linked into toyvm-opcount only. vm_run reports every entry it executes
+ * here (with superinstruction fusion disabled, so each one is a single
+ * opcode) so the fused set in vm_decode.c can be chosen from what real
+ * programs execute. Each run of vm_run keeps its own last two opcodes, so
+ * no pair or triple spans two VMs, and the counts for every VM in the
+ * process are reported once, when it exits.
+ */
+#define OPCOUNT_OPS     xop_count
+#define OPCOUNT_TOP     20
+
+static const char *xop_names[OPCOUNT_OPS] = {
+    [xop_decode]    = "decode",
+    [xop_outside]   = "outside",
+    [xop_bad]       = "bad",
+    [xop_exit]      = "exit",
+    [xop_stkdup]    = "stkdup",
+    [xop_push]      = "push",
+    [xop_readb]     = "readb",
+    [xop_reads]     = "reads",
+    [xop_readw]     = "readw",
+    [xop_storeb]    = "storeb",
+    [xop_stores]    = "stores",
+    [xop_storew]    = "storew",
+    [xop_add]       = "add",
+    [xop_sub]       = "sub",
+    [xop_mul]       = "mul",
+    [xop_div]       = "div",
+    [xop_mod]       = "mod",
+    [xop_inc]       = "inc",
+    [xop_dec]       = "dec",
+    [xop_gets]      = "gets",
+    [xop_saynum]    = "saynum",
+    [xop_saychar]   = "saychar",
+    [xop_saystr]    = "saystr",
+    [xop_memcpy]    = "memcpy",
+    [xop_memset]    = "memset",
+    [xop_memcmp]    = "memcmp",
+    [xop_memchr]    = "memchr",
+    [xop_call]      = "call",
+    [xop_ret]       = "ret",
+    [xop_tailcall]  = "tailcall",
+    [xop_jump]      = "jump",
+    [xop_jumprel]   = "jumprel",
+    [xop_jz]        = "jz",
+    [xop_jnz]       = "jnz",
+    [xop_getframe]  = "getframe",
+    [xop_setframe]  = "setframe",
+    [xop_jump_rel]  = "jump8/16",
+    [xop_jz_rel]    = "jz8/16",
+    [xop_jnz_rel]   = "jnz8/16",
+};
+
+struct opcount_entry {
+    unsigned seq;
+    unsigned long long count;
+};
+
+static unsigned long long single_counts[OPCOUNT_OPS];
+static unsigned long long pair_counts[OPCOUNT_OPS * OPCOUNT_OPS];
+static unsigned long long triple_counts[OPCOUNT_OPS * OPCOUNT_OPS * OPCOUNT_OPS];
+static unsigned long long total_count;
+static int reporting;
+
+static void report_at_exit(void) {
+    vm_opcount_report(stderr);
+}
+
+/* VMs may be running on other threads too */
+static void count(unsigned long long *counter) {
+    __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+void vm_opcount_record(struct vm_opcount_history *history, unsigned xop) {
+    if (!__atomic_load_n(&reporting, __ATOMIC_RELAXED)
+            && !__atomic_exchange_n(&reporting, 1, __ATOMIC_RELAXED)) {
+        atexit(report_at_exit);
+    }
+    history->recent = (history->recent * OPCOUNT_OPS + xop)
+                    % (OPCOUNT_OPS * OPCOUNT_OPS * OPCOUNT_OPS);
+    if (history->length < 3) {
+        ++history->length;
+    }
+    count(&total_count);
+    count(&single_counts[xop]);
+    if (history->length >= 2) {
+        count(&pair_counts[history->recent % (OPCOUNT_OPS * OPCOUNT_OPS)]);
+    }
+    if (history->length >= 3) {
+        count(&triple_counts[history->recent]);
+    }
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct opcount_entry *left = a, *right = b;
+    if (left->count != right->count) {
+        return left->count < right->count ? 1 : -1;
+    }
+    return left->seq < right->seq ? -1 : left->seq > right->seq;
+}
+
+static void print_name(FILE *out, unsigned xop) {
+    if (xop_names[xop]) {
+        fprintf(out, " %-8s", xop_names[xop]);
+    } else {
+        fprintf(out, " 0x%02X    ", xop);
+    }
+}
+
+static void report_table(FILE *out, const char *title, unsigned long long *counts,
+                         unsigned size, int length) {
+    struct opcount_entry *entries = malloc(size * sizeof(struct opcount_entry));
+    if (!entries) return;
+
+    unsigned used = 0;
+    for (unsigned i = 0; i < size; ++i) {
+        if (counts[i] > 0) {
+            entries[used].seq = i;
+            entries[used].count = counts[i];
+            ++used;
+        }
+    }
+    qsort(entries, used, sizeof(struct opcount_entry), compare_entries);
+
+    fprintf(out, "\n%s\n", title);
+    for (unsigned i = 0; i < used && i < OPCOUNT_TOP; ++i) {
+        fprintf(out, "%14llu %6.2f%% ", entries[i].count,
+                100.0 * entries[i].count / total_count);
+        unsigned divisor = 1;
+        for (int j = 1; j < length; ++j) {
+            divisor *= OPCOUNT_OPS;
+        }
+        for (int j = 0; j < length; ++j) {
+            print_name(out, entries[i].seq / divisor % OPCOUNT_OPS);
+            divisor /= OPCOUNT_OPS;
+        }
+        fprintf(out, "\n");
+    }
+    free(entries);
+}
+
+void vm_opcount_report(FILE *out) {
+    fprintf(out, "\n%llu instructions executed\n", total_count);
+    if (total_count == 0) {
+        return;
+    }
+    report_table(out, "Opcodes:", single_counts, OPCOUNT_OPS, 1);
+    report_table(out, "Opcode pairs:", pair_counts, OPCOUNT_OPS * OPCOUNT_OPS, 2);
+    report_table(out, "Opcode triples:", triple_counts,
+                 OPCOUNT_OPS * OPCOUNT_OPS * OPCOUNT_OPS, 3);
+}
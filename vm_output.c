@@ -0,0 +1,171 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * OUTPUT BUFFER                                                             *
+ * ************************************************************************* *
+ * saynum, saychar and saystr append to a per-VM buffer instead of going
+ * through printf, and the buffer goes out in one write (or one call of the
+ * host's callback) when it fills, before gets reads input, when vm_run
+ * returns and when the VM is freed. Writing to a terminal also flushes at
+ * every newline, as stdio would, so prompts and error messages still come
+ * out in order when someone is watching.
+ */
+
+#define VM_OUTPUT_SIZE      65536
+
+struct vm_output {
+    int fd;
+    int line_buffered;
+    vm_output_callback callback;
+    void *data;
+
+    unsigned length;
+    char buffer[VM_OUTPUT_SIZE];
+};
+
+static void emit(struct vm_output *out, const char *text, size_t length) {
+    if (out->callback) {
+        out->callback(out->data, text, length);
+        return;
+    }
+    if (out->fd == STDOUT_FILENO) {
+        /* keep anything the host printed itself ahead of the VM's output */
+        fflush(stdout);
+    }
+    while (length > 0) {
+        ssize_t written = write(out->fd, text, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            /* nowhere to report it; drop the output as printf would */
+            return;
+        }
+        text += written;
+        length -= written;
+    }
+}
+
+static void append(struct vm_output *out, const char *text, size_t length) {
+    if (length > VM_OUTPUT_SIZE - out->length) {
+        emit(out, out->buffer, out->length);
+        out->length = 0;
+        if (length >= VM_OUTPUT_SIZE) {
+            emit(out, text, length);
+            return;
+        }
+    }
+    memcpy(&out->buffer[out->length], text, length);
+    out->length += length;
+}
+
+int vm_output_init(struct vmstate *vm) {
+    vm->output = malloc(sizeof(struct vm_output));
+    if (!vm->output) {
+        return 0;
+    }
+    vm->output->length = 0;
+    vm->output->callback = NULL;
+    vm->output->data = NULL;
+    vm->output->fd = -1;
+    vm_set_output_fd(vm, STDOUT_FILENO);
+    return 1;
+}
+
+void vm_output_free(struct vmstate *vm) {
+    if (vm->output) {
+        vm_flush_output(vm);
+        free(vm->output);
+        vm->output = NULL;
+    }
+}
+
+void vm_flush_output(struct vmstate *vm) {
+    struct vm_output *out = vm->output;
+    if (out && out->length > 0) {
+        emit(out, out->buffer, out->length);
+        out->length = 0;
+    }
+}
+
+void vm_set_output_fd(struct vmstate *vm, int fd) {
+    vm_flush_output(vm);
+    vm->output->fd = fd;
+    vm->output->line_buffered = isatty(fd);
+    vm->output->callback = NULL;
+    vm->output->data = NULL;
+}
+
+void vm_set_output_callback(struct vmstate *vm, vm_output_callback callback,
+                            void *data) {
+    vm_flush_output(vm);
+    vm->output->line_buffered = 0;
+    vm->output->callback = callback;
+    vm->output->data = data;
+}
+
+/* two digits at a time, so a number costs one division per pair */
+static const char digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+void vm_io_saynum(struct vmstate *vm, int value) {
+    VM_STAT_ADD(vm->stats->io_ops, 1);
+    char text[12];
+    char *start = text + sizeof(text);
+    unsigned number = value < 0 ? 0u - (unsigned)value : (unsigned)value;
+
+    while (number >= 100) {
+        unsigned pair = number % 100 * 2;
+        number /= 100;
+        start -= 2;
+        start[0] = digit_pairs[pair];
+        start[1] = digit_pairs[pair + 1];
+    }
+    if (number >= 10) {
+        start -= 2;
+        start[0] = digit_pairs[number * 2];
+        start[1] = digit_pairs[number * 2 + 1];
+    } else {
+        *--start = '0' + number;
+    }
+    if (value < 0) {
+        *--start = '-';
+    }
+    append(vm->output, start, text + sizeof(text) - start);
+}
+
+void vm_io_saychar(struct vmstate *vm, int value) {
+    VM_STAT_ADD(vm->stats->io_ops, 1);
+    struct vm_output *out = vm->output;
+    if (out->length == VM_OUTPUT_SIZE) {
+        vm_flush_output(vm);
+    }
+    out->buffer[out->length++] = (char)value;
+    if (out->line_buffered && value == '\n') {
+        vm_flush_output(vm);
+    }
+}
+
+/* Keeps to memory itself, like the rest of the I/O operations. */
+void vm_io_saystr(struct vmstate *vm, unsigned address) {
+    VM_STAT_ADD(vm->stats->io_ops, 1);
+    if (address >= vm->memory_size) {
+        return;
+    }
+    const char *text = (const char*)&vm->fixed_memory[address];
+    const char *end = memchr(text, 0, vm->memory_size - address);
+    size_t length = end ? (size_t)(end - text) : vm->memory_size - address;
+
+    append(vm->output, text, length);
+    if (vm->output->line_buffered && memchr(text, '\n', length)) {
+        vm_flush_output(vm);
+    }
+}
@@ -0,0 +1,286 @@
+#define _POSIX_C_SOURCE 199309L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * EXECUTION PROFILE                                                         *
+ * ************************************************************************* *
+ * Linked in by "make PROFILE=1" only. vm_run reports every decoded entry it
+ * dispatches here, and each one is charged the time until the next
+ * dispatch: its own handler, any I/O it did and the dispatch itself. Time
+ * between vm_run_for calls is not charged to anything. Counts are kept per
+ * handler (so a fused push+add shows up as add_imm, not as two opcodes) and
+ * per address of the entry's first byte.
+ *
+ * When the VM is freed the report goes to stderr, with each hot address
+ * attributed to the nearest label at or before it in labels.txt (which the
+ * assembler writes to the current directory), and the same totals summed
+ * per label to show which functions are hot. Only the interpreter is
+ * profiled, not code run by vm_run_jit.
+ */
+#define PROFILE_TOP     20
+#define PROFILE_NONE    0xFFFFFFFFu
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TICK_UNIT "cycles"
+static unsigned long long ticks(void) {
+    return __rdtsc();
+}
+#else
+#define TICK_UNIT "ns"
+static unsigned long long ticks(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+#endif
+
+static const char *xop_names[xop_count] = {
+    [xop_decode]        = "decode",
+    [xop_outside]       = "outside",
+    [xop_bad]           = "bad",
+    [xop_exit]          = "exit",
+    [xop_stkdup]        = "stkdup",
+    [xop_push]          = "push",
+    [xop_readb]         = "readb",
+    [xop_reads]         = "reads",
+    [xop_readw]         = "readw",
+    [xop_storeb]        = "storeb",
+    [xop_stores]        = "stores",
+    [xop_storew]        = "storew",
+    [xop_add]           = "add",
+    [xop_sub]           = "sub",
+    [xop_mul]           = "mul",
+    [xop_div]           = "div",
+    [xop_mod]           = "mod",
+    [xop_inc]           = "inc",
+    [xop_dec]           = "dec",
+    [xop_gets]          = "gets",
+    [xop_saynum]        = "saynum",
+    [xop_saychar]       = "saychar",
+    [xop_saystr]        = "saystr",
+    [xop_memcpy]        = "memcpy",
+    [xop_memset]        = "memset",
+    [xop_memcmp]        = "memcmp",
+    [xop_memchr]        = "memchr",
+    [xop_call]          = "call",
+    [xop_ret]           = "ret",
+    [xop_tailcall]      = "tailcall",
+    [xop_jump]          = "jump",
+    [xop_jumprel]       = "jumprel",
+    [xop_jz]            = "jz",
+    [xop_jnz]           = "jnz",
+    [xop_getframe]      = "getframe",
+    [xop_setframe]      = "setframe",
+    [xop_readb_imm]     = "readb_imm",
+    [xop_reads_imm]     = "reads_imm",
+    [xop_readw_imm]     = "readw_imm",
+    [xop_storeb_imm]    = "storeb_imm",
+    [xop_stores_imm]    = "stores_imm",
+    [xop_storew_imm]    = "storew_imm",
+    [xop_add_imm]       = "add_imm",
+    [xop_sub_imm]       = "sub_imm",
+    [xop_saychar_imm]   = "saychar_imm",
+    [xop_saystr_imm]    = "saystr_imm",
+    [xop_call_imm]      = "call_imm",
+    [xop_tailcall_imm]  = "tailcall_imm",
+    [xop_jump_imm]      = "jump_imm",
+    [xop_jz_imm]        = "jz_imm",
+    [xop_jnz_imm]       = "jnz_imm",
+    [xop_dup_jnz_imm]   = "dup_jnz_imm",
+    [xop_jump_rel]      = "jump_rel",
+    [xop_jz_rel]        = "jz_rel",
+    [xop_jnz_rel]       = "jnz_rel",
+    [xop_dup_jnz_rel]   = "dup_jnz_rel",
+};
+
+struct vm_profile {
+    unsigned long long *counts;     /* per address */
+    unsigned long long *cycles;
+    unsigned long long xop_counts[xop_count];
+    unsigned long long xop_cycles[xop_count];
+    unsigned long long total_count, total_cycles;
+
+    /* the entry being charged and when it started */
+    unsigned last_address;
+    unsigned last_xop;
+    unsigned long long last_tick;
+};
+
+struct profile_entry {
+    unsigned key;
+    unsigned long long count;
+    unsigned long long cycles;
+};
+
+static void charge(struct vm_profile *profile, unsigned long long now) {
+    if (profile->last_address == PROFILE_NONE) {
+        return;
+    }
+    unsigned long long spent = now - profile->last_tick;
+    profile->cycles[profile->last_address] += spent;
+    profile->xop_cycles[profile->last_xop] += spent;
+    profile->total_cycles += spent;
+    profile->last_address = PROFILE_NONE;
+}
+
+/* Called as vm_continue enters the interpreter. */
+void vm_profile_resume(struct vmstate *vm) {
+    if (!vm->profile) {
+        vm->profile = calloc(1, sizeof(struct vm_profile));
+        if (!vm->profile) return;
+        vm->profile->counts = calloc(vm->memory_size + 1, sizeof(unsigned long long));
+        vm->profile->cycles = calloc(vm->memory_size + 1, sizeof(unsigned long long));
+        if (!vm->profile->counts || !vm->profile->cycles) {
+            free(vm->profile->counts);
+            free(vm->profile->cycles);
+            free(vm->profile);
+            vm->profile = NULL;
+            return;
+        }
+    }
+    vm->profile->last_address = PROFILE_NONE;
+}
+
+/* ...and as it leaves, which ends the last entry's share. */
+void vm_profile_pause(struct vmstate *vm) {
+    if (vm->profile) {
+        charge(vm->profile, ticks());
+    }
+}
+
+void vm_profile_record(struct vmstate *vm, unsigned address, unsigned xop) {
+    struct vm_profile *profile = vm->profile;
+    if (!profile) return;
+    unsigned long long now = ticks();
+    charge(profile, now);
+    ++profile->counts[address];
+    ++profile->xop_counts[xop];
+    ++profile->total_count;
+    profile->last_address = address;
+    profile->last_xop = xop;
+    profile->last_tick = now;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const struct profile_entry *left = a, *right = b;
+    if (left->cycles != right->cycles) {
+        return left->cycles < right->cycles ? 1 : -1;
+    }
+    return left->key < right->key ? -1 : left->key > right->key;
+}
+
+static void print_row(FILE *out, const struct vm_profile *profile,
+                      const struct profile_entry *entry) {
+    fprintf(out, "%14llu %6.2f%% %16llu %6.2f%% %8.1f  ",
+            entry->count, 100.0 * entry->count / profile->total_count,
+            entry->cycles, 100.0 * entry->cycles / (profile->total_cycles ? profile->total_cycles : 1),
+            entry->count ? (double)entry->cycles / entry->count : 0.0);
+}
+
+static void print_header(FILE *out, const char *title) {
+    fprintf(out, "\n%s\n%14s %7s %16s %7s %8s\n", title,
+            "count", "%", TICK_UNIT, "%", "each");
+}
+
+void vm_profile_report(struct vmstate *vm, FILE *out) {
+    struct vm_profile *profile = vm->profile;
+    if (!profile || profile->total_count == 0) {
+        return;
+    }
+    unsigned label_count;
+    struct vm_label *labels = vm_labels_load("labels.txt", &label_count);
+    unsigned size = vm->memory_size > xop_count ? vm->memory_size : xop_count;
+    if (size < label_count) {
+        size = label_count;
+    }
+    struct profile_entry *entries = malloc((size + 1) * sizeof(struct profile_entry));
+    if (!entries) {
+        free(labels);
+        return;
+    }
+
+    fprintf(out, "\n%llu instructions executed in %llu %s\n",
+            profile->total_count, profile->total_cycles, TICK_UNIT);
+
+    unsigned used = 0;
+    for (unsigned xop = 0; xop < xop_count; ++xop) {
+        if (profile->xop_counts[xop]) {
+            entries[used].key = xop;
+            entries[used].count = profile->xop_counts[xop];
+            entries[used].cycles = profile->xop_cycles[xop];
+            ++used;
+        }
+    }
+    qsort(entries, used, sizeof(struct profile_entry), compare_entries);
+    print_header(out, "Handlers:");
+    for (unsigned i = 0; i < used; ++i) {
+        print_row(out, profile, &entries[i]);
+        fprintf(out, "%s\n", xop_names[entries[i].key]);
+    }
+
+    used = 0;
+    for (unsigned address = 0; address < vm->memory_size; ++address) {
+        if (profile->counts[address]) {
+            entries[used].key = address;
+            entries[used].count = profile->counts[address];
+            entries[used].cycles = profile->cycles[address];
+            ++used;
+        }
+    }
+    qsort(entries, used, sizeof(struct profile_entry), compare_entries);
+    print_header(out, "Addresses:");
+    for (unsigned i = 0; i < used && i < PROFILE_TOP; ++i) {
+        int label = vm_labels_find(labels, label_count, entries[i].key);
+        print_row(out, profile, &entries[i]);
+        fprintf(out, "0x%08X  %-12s", entries[i].key, xop_names[vm->code[entries[i].key].xop]);
+        if (label >= 0) {
+            fprintf(out, "  %s+%u", labels[label].name,
+                    entries[i].key - labels[label].address);
+        }
+        fprintf(out, "\n");
+    }
+
+    if (labels) {
+        /* one entry per label, keyed by its index; addresses before the
+         * first label go to an extra one at the end */
+        for (unsigned i = 0; i <= label_count; ++i) {
+            entries[i].key = i;
+            entries[i].count = entries[i].cycles = 0;
+        }
+        for (unsigned address = 0; address < vm->memory_size; ++address) {
+            if (profile->counts[address]) {
+                int label = vm_labels_find(labels, label_count, address);
+                struct profile_entry *entry = &entries[label >= 0 ? (unsigned)label : label_count];
+                entry->count += profile->counts[address];
+                entry->cycles += profile->cycles[address];
+            }
+        }
+        qsort(entries, label_count + 1, sizeof(struct profile_entry), compare_entries);
+        print_header(out, "Labels:");
+        for (unsigned i = 0; i <= label_count && i < PROFILE_TOP && entries[i].count; ++i) {
+            print_row(out, profile, &entries[i]);
+            fprintf(out, "%s\n", entries[i].key < label_count
+                                 ? labels[entries[i].key].name : "(before any label)");
+        }
+    }
+    free(entries);
+    free(labels);
+}
+
+void vm_profile_free(struct vmstate *vm) {
+    if (vm->profile) {
+        free(vm->profile->counts);
+        free(vm->profile->cycles);
+        free(vm->profile);
+        vm->profile = NULL;
+    }
+}
@@ -0,0 +1,204 @@
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * SAMPLING PROFILER                                                         *
+ * ************************************************************************* *
+ * Unlike make PROFILE=1 this costs nothing until it is started, and little
+ * after: an ITIMER_PROF timer sends SIGPROF every so much CPU time, and the
+ * handler records a sample for whichever VM the interrupted thread is
+ * running (vm_guarded_run keeps track; see vm_guard.c). A sample is vm->pc
+ * followed by the return address in each frame, found by following the
+ * return stack from vm->call_frame, which is always up to date in memory,
+ * in the interpreter and the JIT alike. vm->pc is where the last call,
+ * return or memory access was, so it is always inside the function that is
+ * running, if not always at the very instruction.
+ *
+ * Samples go into a buffer allocated up front, so the handler only reads
+ * memory and bumps a counter; once the buffer is full, further samples are
+ * counted as dropped. vm_sample_write turns them into folded stacks, one
+ * "outermost;...;innermost count" line per distinct stack, with each
+ * address named after its label, for flamegraph.pl and similar tools.
+ */
+#define SAMPLE_DEFAULT_HZ   1000
+#define SAMPLE_CAPACITY     (1 << 18)
+#define SAMPLE_DEPTH        31
+
+struct sample {
+    unsigned depth;                 /* 0 when no VM was running */
+    unsigned pcs[SAMPLE_DEPTH];     /* innermost first */
+};
+
+static struct sample *samples;
+static unsigned sample_count;
+static struct sigaction previous_action;
+
+static void sample_handler(int signal) {
+    int saved_errno = errno;
+    unsigned slot = __atomic_fetch_add(&sample_count, 1, __ATOMIC_RELAXED);
+    if (slot >= SAMPLE_CAPACITY) {
+        return;
+    }
+    struct sample *sample = &samples[slot];
+    struct vmstate *vm = vm_guard_current();
+    unsigned depth = 0;
+    if (vm) {
+        /* frames are never freed while the VM is running and their prev
+         * links never change, so the walk is safe even if the handler
+         * caught a call or ret halfway */
+        const struct vm_frame *frame = vm->call_frame;
+        sample->pcs[depth++] = vm->pc;
+        while (depth < SAMPLE_DEPTH && frame && frame->prev) {
+            sample->pcs[depth++] = frame->ret_addr;
+            frame = frame->prev;
+        }
+    }
+    sample->depth = depth;
+    errno = saved_errno;
+}
+
+/* Starts sampling every VM in the process, hz times per second of CPU
+ * time (a default rate if 0), discarding any earlier samples. */
+int vm_sample_start(unsigned hz) {
+    if (!samples) {
+        samples = malloc(SAMPLE_CAPACITY * sizeof(struct sample));
+        if (!samples) {
+            return 0;
+        }
+    }
+    if (hz == 0) {
+        hz = SAMPLE_DEFAULT_HZ;
+    }
+    sample_count = 0;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = sample_handler;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previous_action) != 0) {
+        return 0;
+    }
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = hz > 1000000 ? 1 : 1000000 / hz;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        sigaction(SIGPROF, &previous_action, NULL);
+        return 0;
+    }
+    return 1;
+}
+
+void vm_sample_stop(void) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    sigaction(SIGPROF, &previous_action, NULL);
+}
+
+static void append(char **line, size_t *length, size_t *capacity, const char *text) {
+    size_t add = strlen(text);
+    if (!*line) return;
+    if (*length + add + 1 > *capacity) {
+        *capacity = (*length + add + 1) * 2;
+        char *new_line = realloc(*line, *capacity);
+        if (!new_line) {
+            free(*line);
+            *line = NULL;
+            return;
+        }
+        *line = new_line;
+    }
+    memcpy(*line + *length, text, add + 1);
+    *length += add;
+}
+
+/* A return address names the function it returns into; the call just
+ * before it is what is in that function. */
+static void frame_name(char *name, size_t size, const struct vm_label *labels,
+                       unsigned label_count, unsigned pc, int is_return) {
+    int label = vm_labels_find(labels, label_count, is_return && pc > 0 ? pc - 1 : pc);
+    if (label >= 0) {
+        snprintf(name, size, "%s", labels[label].name);
+    } else {
+        snprintf(name, size, "0x%08X", pc);
+    }
+}
+
+static int compare_lines(const void *a, const void *b) {
+    return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+/* Writes the samples taken since vm_sample_start to filename as folded
+ * stacks, naming addresses from labels_file (see vm_labels.c) if it can be
+ * read. */
+int vm_sample_write(const char *filename, const char *labels_file) {
+    unsigned count = sample_count < SAMPLE_CAPACITY ? sample_count : SAMPLE_CAPACITY;
+    unsigned label_count = 0;
+    FILE *out = fopen(filename, "wt");
+    if (!out) {
+        return 0;
+    }
+    struct vm_label *labels = labels_file ? vm_labels_load(labels_file, &label_count) : NULL;
+    char **lines = malloc((count + 1) * sizeof(char*));
+    if (!lines) {
+        free(labels);
+        fclose(out);
+        return 0;
+    }
+
+    int ok = 1;
+    for (unsigned i = 0; i < count; ++i) {
+        const struct sample *sample = &samples[i];
+        size_t length = 0, capacity = 64;
+        char name[80];
+        lines[i] = malloc(capacity);
+        if (lines[i]) {
+            lines[i][0] = 0;
+        }
+        if (sample->depth == 0) {
+            append(&lines[i], &length, &capacity, "[host]");
+        }
+        for (unsigned j = sample->depth; j-- > 0; ) {
+            frame_name(name, sizeof(name), labels, label_count, sample->pcs[j], j > 0);
+            append(&lines[i], &length, &capacity, name);
+            if (j > 0) {
+                append(&lines[i], &length, &capacity, ";");
+            }
+        }
+        if (!lines[i]) {
+            count = i;
+            ok = 0;
+            break;
+        }
+    }
+
+    qsort(lines, count, sizeof(char*), compare_lines);
+    for (unsigned i = 0; i < count; ) {
+        unsigned same = i + 1;
+        while (same < count && strcmp(lines[same], lines[i]) == 0) {
+            ++same;
+        }
+        fprintf(out, "%s %u\n", lines[i], same - i);
+        i = same;
+    }
+    if (sample_count > SAMPLE_CAPACITY) {
+        fprintf(out, "[dropped] %u\n", sample_count - SAMPLE_CAPACITY);
+    }
+    for (unsigned i = 0; i < count; ++i) {
+        free(lines[i]);
+    }
+    free(lines);
+    free(labels);
+    ok = !ferror(out) && ok;
+    return fclose(out) == 0 && ok;
+}
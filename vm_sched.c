@@ -0,0 +1,378 @@
+#define _DEFAULT_SOURCE
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * SCHEDULER                                                                 *
+ * ************************************************************************* *
+ * Runs many VMs on a pool of worker threads, one per core by default. Each
+ * worker has its own run queue; it runs the task at the front for a slice
+ * of vm_run_for and puts it back at the end if it is not finished, and
+ * when its own queue is empty it steals from the others before going to
+ * sleep. A VM that reaches gets with no line to read is parked, off every
+ * queue, until vm_sched_input or vm_sched_close_input gives it one.
+ *
+ * A task is only ever in one queue or running on one worker, so the VM
+ * itself needs no locking; the input the host hands over while it runs is
+ * kept in the task and passed to the VM between slices.
+ */
+
+#define VM_SCHED_DEFAULT_SLICE  100000
+
+enum task_state {
+    task_queued,
+    task_running,
+    task_parked,
+    task_done
+};
+
+struct vm_task {
+    struct vmstate *vm;
+    struct vm_task *queue_next;
+    struct vm_task *all_next;       /* every task, for vm_sched_free */
+
+    pthread_mutex_t lock;           /* guards everything below */
+    enum task_state state;
+    char *input;                    /* not handed to the VM yet */
+    unsigned input_length, input_capacity;
+    int input_closed;               /* 1 once closed, 2 once the VM knows */
+};
+
+struct run_queue {
+    pthread_mutex_t lock;
+    struct vm_task *head, *tail;
+};
+
+struct worker {
+    struct vm_scheduler *sched;
+    unsigned index;
+    pthread_t thread;
+};
+
+struct vm_scheduler {
+    unsigned long slice;
+    vm_task_done done;
+    void *data;
+    unsigned worker_count;
+    struct worker *workers;
+    struct run_queue *queues;
+    unsigned next_queue;            /* for tasks arriving from outside */
+    unsigned sleepers;
+
+    pthread_mutex_t lock;           /* guards everything below */
+    pthread_cond_t work_ready;
+    pthread_cond_t idle;
+    unsigned active;                /* tasks queued or running */
+    unsigned parked;
+    int shutting_down;
+    struct vm_task *tasks;
+};
+
+
+/* ************************************************************************* *
+ * RUN QUEUES                                                                *
+ * ************************************************************************* */
+static void queue_push(struct run_queue *queue, struct vm_task *task) {
+    pthread_mutex_lock(&queue->lock);
+    task->queue_next = NULL;
+    if (queue->tail) {
+        queue->tail->queue_next = task;
+    } else {
+        queue->head = task;
+    }
+    queue->tail = task;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static struct vm_task* queue_pop(struct run_queue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    struct vm_task *task = queue->head;
+    if (task) {
+        queue->head = task->queue_next;
+        if (!queue->head) {
+            queue->tail = NULL;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+/* The worker's own queue first, then everyone else's. */
+static struct vm_task* take_task(struct vm_scheduler *sched, unsigned index) {
+    for (unsigned i = 0; i < sched->worker_count; ++i) {
+        struct vm_task *task = queue_pop(&sched->queues[(index + i) % sched->worker_count]);
+        if (task) {
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void enqueue(struct vm_scheduler *sched, unsigned index, struct vm_task *task) {
+    queue_push(&sched->queues[index], task);
+    /* pairs with the increment in worker_main: either that worker sees
+     * the task when it looks again, or this sees it asleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&sched->sleepers, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&sched->lock);
+        pthread_cond_signal(&sched->work_ready);
+        pthread_mutex_unlock(&sched->lock);
+    }
+}
+
+static void enqueue_from_outside(struct vm_scheduler *sched, struct vm_task *task) {
+    unsigned index = __atomic_fetch_add(&sched->next_queue, 1, __ATOMIC_RELAXED);
+    enqueue(sched, index % sched->worker_count, task);
+}
+
+/* A task stops or starts counting as active; vm_sched_wait waits for none. */
+static void set_active(struct vm_scheduler *sched, int active, int parked) {
+    pthread_mutex_lock(&sched->lock);
+    sched->active += active;
+    sched->parked += parked;
+    if (sched->active == 0) {
+        pthread_cond_broadcast(&sched->idle);
+    }
+    pthread_mutex_unlock(&sched->lock);
+}
+
+
+/* ************************************************************************* *
+ * WORKERS                                                                   *
+ * ************************************************************************* */
+static void run_slice(struct vm_scheduler *sched, unsigned index, struct vm_task *task) {
+    struct vmstate *vm = task->vm;
+
+    pthread_mutex_lock(&task->lock);
+    if (task->input_length > 0) {
+        vm_provide_input(vm, task->input, task->input_length);
+        task->input_length = 0;
+    }
+    if (task->input_closed == 1) {
+        vm_close_input(vm);
+        task->input_closed = 2;
+    }
+    task->state = task_running;
+    pthread_mutex_unlock(&task->lock);
+
+    enum vm_status status = vm_run_for(vm, sched->slice);
+
+    pthread_mutex_lock(&task->lock);
+    if (status == vm_status_paused
+            || (status == vm_status_waiting
+                && (task->input_length > 0 || task->input_closed == 1))) {
+        task->state = task_queued;
+        pthread_mutex_unlock(&task->lock);
+        enqueue(sched, index, task);
+    } else if (status == vm_status_waiting) {
+        task->state = task_parked;
+        pthread_mutex_unlock(&task->lock);
+        set_active(sched, -1, 1);
+    } else {
+        task->state = task_done;
+        pthread_mutex_unlock(&task->lock);
+        if (sched->done) {
+            sched->done(sched->data, task, vm, status);
+        }
+        set_active(sched, -1, 0);
+    }
+}
+
+static void* worker_main(void *arg) {
+    struct worker *self = arg;
+    struct vm_scheduler *sched = self->sched;
+
+    while (1) {
+        struct vm_task *task = take_task(sched, self->index);
+        if (!task) {
+            pthread_mutex_lock(&sched->lock);
+            __atomic_add_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+            while (!sched->shutting_down
+                    && !(task = take_task(sched, self->index))) {
+                pthread_cond_wait(&sched->work_ready, &sched->lock);
+            }
+            __atomic_sub_fetch(&sched->sleepers, 1, __ATOMIC_SEQ_CST);
+            pthread_mutex_unlock(&sched->lock);
+            if (!task) {
+                return NULL;
+            }
+        }
+        run_slice(sched, self->index, task);
+    }
+}
+
+
+/* ************************************************************************* *
+ * INTERFACE                                                                 *
+ * ************************************************************************* */
+static void stop_workers(struct vm_scheduler *sched, unsigned started) {
+    pthread_mutex_lock(&sched->lock);
+    sched->shutting_down = 1;
+    pthread_cond_broadcast(&sched->work_ready);
+    pthread_mutex_unlock(&sched->lock);
+    for (unsigned i = 0; i < started; ++i) {
+        pthread_join(sched->workers[i].thread, NULL);
+    }
+}
+
+/* workers and slice may be 0 for one worker per core and the default
+ * slice. done is called from a worker thread as each task finishes, after
+ * which the scheduler does not touch its VM again. */
+struct vm_scheduler* vm_sched_create(unsigned workers, unsigned long slice,
+                                     vm_task_done done, void *data) {
+    struct vm_scheduler *sched = calloc(1, sizeof(struct vm_scheduler));
+    if (!sched) {
+        return NULL;
+    }
+    if (workers == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? cores : 1;
+    }
+    sched->slice = slice ? slice : VM_SCHED_DEFAULT_SLICE;
+    sched->done = done;
+    sched->data = data;
+    sched->worker_count = workers;
+    sched->workers = calloc(workers, sizeof(struct worker));
+    sched->queues = calloc(workers, sizeof(struct run_queue));
+    if (!sched->workers || !sched->queues) {
+        free(sched->workers);
+        free(sched->queues);
+        free(sched);
+        return NULL;
+    }
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_cond_init(&sched->work_ready, NULL);
+    pthread_cond_init(&sched->idle, NULL);
+    for (unsigned i = 0; i < workers; ++i) {
+        pthread_mutex_init(&sched->queues[i].lock, NULL);
+    }
+    for (unsigned i = 0; i < workers; ++i) {
+        sched->workers[i].sched = sched;
+        sched->workers[i].index = i;
+        if (pthread_create(&sched->workers[i].thread, NULL, worker_main,
+                           &sched->workers[i]) != 0) {
+            stop_workers(sched, i);
+            sched->worker_count = 0;
+            vm_sched_free(sched);
+            return NULL;
+        }
+    }
+    return sched;
+}
+
+/* Starts running vm from start_address, with its gets reading only what
+ * vm_sched_input provides. Returns NULL if it cannot. */
+struct vm_task* vm_sched_add(struct vm_scheduler *sched, struct vmstate *vm,
+                             unsigned start_address) {
+    struct vm_task *task = calloc(1, sizeof(struct vm_task));
+    if (!task) {
+        return NULL;
+    }
+    if (!vm_start(vm, start_address)) {
+        free(task);
+        return NULL;
+    }
+    /* gets must never block a worker on stdin */
+    vm_provide_input(vm, "", 0);
+    task->vm = vm;
+    task->state = task_queued;
+    pthread_mutex_init(&task->lock, NULL);
+
+    pthread_mutex_lock(&sched->lock);
+    task->all_next = sched->tasks;
+    sched->tasks = task;
+    ++sched->active;
+    pthread_mutex_unlock(&sched->lock);
+    enqueue_from_outside(sched, task);
+    return task;
+}
+
+static void wake_parked(struct vm_scheduler *sched, struct vm_task *task) {
+    if (task->state == task_parked) {
+        task->state = task_queued;
+        pthread_mutex_unlock(&task->lock);
+        set_active(sched, 1, -1);
+        enqueue_from_outside(sched, task);
+    } else {
+        pthread_mutex_unlock(&task->lock);
+    }
+}
+
+/* Queues input for the task's gets; see vm_provide_input. */
+void vm_sched_input(struct vm_scheduler *sched, struct vm_task *task,
+                    const char *text, unsigned length) {
+    pthread_mutex_lock(&task->lock);
+    if (task->state == task_done || task->input_closed) {
+        pthread_mutex_unlock(&task->lock);
+        return;
+    }
+    if (length > task->input_capacity - task->input_length) {
+        unsigned capacity = task->input_capacity ? task->input_capacity : 256;
+        while (capacity - task->input_length < length) {
+            capacity *= 2;
+        }
+        char *input = realloc(task->input, capacity);
+        if (!input) {
+            pthread_mutex_unlock(&task->lock);
+            return;
+        }
+        task->input = input;
+        task->input_capacity = capacity;
+    }
+    memcpy(&task->input[task->input_length], text, length);
+    task->input_length += length;
+    wake_parked(sched, task);
+}
+
+void vm_sched_close_input(struct vm_scheduler *sched, struct vm_task *task) {
+    pthread_mutex_lock(&task->lock);
+    if (task->state == task_done || task->input_closed) {
+        pthread_mutex_unlock(&task->lock);
+        return;
+    }
+    task->input_closed = 1;
+    wake_parked(sched, task);
+}
+
+/* Waits until every task has finished or is parked waiting for input, and
+ * returns how many are parked. */
+unsigned vm_sched_wait(struct vm_scheduler *sched) {
+    pthread_mutex_lock(&sched->lock);
+    while (sched->active > 0) {
+        pthread_cond_wait(&sched->idle, &sched->lock);
+    }
+    unsigned parked = sched->parked;
+    pthread_mutex_unlock(&sched->lock);
+    return parked;
+}
+
+unsigned vm_sched_worker_count(struct vm_scheduler *sched) {
+    return sched->worker_count;
+}
+
+/* Stops the workers and frees every task, but none of their VMs. Tasks
+ * that have not finished are simply dropped. */
+void vm_sched_free(struct vm_scheduler *sched) {
+    stop_workers(sched, sched->worker_count);
+    while (sched->tasks) {
+        struct vm_task *task = sched->tasks;
+        sched->tasks = task->all_next;
+        pthread_mutex_destroy(&task->lock);
+        free(task->input);
+        free(task);
+    }
+    for (unsigned i = 0; i < sched->worker_count; ++i) {
+        pthread_mutex_destroy(&sched->queues[i].lock);
+    }
+    pthread_cond_destroy(&sched->idle);
+    pthread_cond_destroy(&sched->work_ready);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->workers);
+    free(sched->queues);
+    free(sched);
+}
@@ -0,0 +1,449 @@
+#define _DEFAULT_SOURCE
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * SNAPSHOTS                                                                 *
+ * ************************************************************************* *
+ * vm_snapshot writes a paused, stopped or waiting VM to a file laid out so
+ * vm_restore can map it rather than read it: a header page, then the
+ * memory image, then the writable pages of the stack exactly as vm_guard.c
+ * arranges them, each starting on a page boundary. Both are mapped
+ * MAP_PRIVATE, so restoring costs a few system calls whatever the size of
+ * the image, pages are only read in as the VM touches them, and any number
+ * of VMs can be restored from one snapshot.
+ *
+ * The stack holds no pointers, so besides the two mappings only stack_ptr,
+ * the resume point and the return stack need to be kept; the return stack
+ * (see vm_frames.c) follows the stack pages as frame_count records, the
+ * outermost first, whose bases are offsets from vm->stack and so position
+ * independent too. Snapshots are in host byte order and page
+ * size, and are trusted like the host's own memory: restoring checks that
+ * the header is consistent, not what the stack holds.
+ *
+ * Checkpoints are the incremental form. Every write to memory, whether by
+ * a store, gets or the host's vm_store_*, sets a byte in vm->dirty for its
+ * VM_DIRTY_BLOCK sized block, next to the code_marks check vm_mem_written
+ * already makes. vm_checkpoint writes just the dirty blocks, the stack and
+ * the resume point, then clears vm->dirty, as a successful vm_snapshot
+ * does too. The file is a checkpoint_header followed by block_count
+ * records of a block index and that block's bytes (the last block of
+ * memory may be short), then stack_depth words of stack, then frame_count
+ * return stack records.
+ */
+
+#define SNAPSHOT_MAGIC      "toyvmsnp"
+#define SNAPSHOT_VERSION    3
+
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t memory_size;
+    uint32_t stack_size;
+    uint32_t stack_depth;       /* words from vm->stack to stack_ptr */
+    uint32_t frame_count;       /* struct vm_frame_records */
+    uint32_t resume_pc;
+    uint32_t resume_verified;
+    uint64_t memory_offset;
+    uint64_t stack_offset;
+    uint64_t frames_offset;
+};
+
+static size_t round_to_page(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (size + page - 1) / page * page;
+}
+
+#define CHECKPOINT_MAGIC    "toyvmckp"
+#define CHECKPOINT_VERSION  3
+
+struct checkpoint_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t memory_size;
+    uint32_t block_size;
+    uint32_t block_count;
+    uint32_t stack_size;
+    uint32_t stack_depth;
+    uint32_t frame_count;
+    uint32_t resume_pc;
+    uint32_t resume_verified;
+};
+
+/* Files are written under a temporary name that then replaces filename, so
+ * a crash never leaves half a file behind and VMs already restored from an
+ * older snapshot of the same name keep their pages. */
+static int create_temp(const char *filename, char **temp) {
+    *temp = malloc(strlen(filename) + sizeof(".XXXXXX"));
+    if (!*temp) {
+        return -1;
+    }
+    sprintf(*temp, "%s.XXXXXX", filename);
+    int fd = mkstemp(*temp);
+    if (fd == -1) {
+        free(*temp);
+    }
+    return fd;
+}
+
+static int replace_file(char *temp, const char *filename, int ok) {
+    if (!ok || rename(temp, filename) != 0) {
+        unlink(temp);
+        ok = 0;
+    }
+    free(temp);
+    return ok;
+}
+
+static unsigned block_count(unsigned memory_size) {
+    return (memory_size + VM_DIRTY_BLOCK - 1) >> VM_DIRTY_SHIFT;
+}
+
+static unsigned block_length(unsigned memory_size, unsigned block) {
+    unsigned start = block << VM_DIRTY_SHIFT;
+    return memory_size - start < VM_DIRTY_BLOCK ? memory_size - start : VM_DIRTY_BLOCK;
+}
+
+int vm_dirty_init(struct vmstate *vm) {
+    vm->dirty = calloc(((vm->memory_size + sizeof(uint32_t)) >> VM_DIRTY_SHIFT) + 1, 1);
+    return vm->dirty != NULL;
+}
+
+void vm_dirty_free(struct vmstate *vm) {
+    free(vm->dirty);
+    vm->dirty = NULL;
+}
+
+static void clear_dirty(struct vmstate *vm) {
+    memset(vm->dirty, 0, ((vm->memory_size + sizeof(uint32_t)) >> VM_DIRTY_SHIFT) + 1);
+}
+
+int vm_snapshot(struct vmstate *vm, const char *filename) {
+    if (!vm->resumable || !vm->guard) {
+        return 0;
+    }
+    vm_flush_output(vm);
+
+    struct snapshot_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.page_size = sysconf(_SC_PAGESIZE);
+    header.memory_size = vm->memory_size;
+    header.stack_size = vm->stack_size;
+    header.stack_depth = vm->stack_ptr - vm->stack;
+    header.resume_pc = vm->resume_pc;
+    /* a write to verified code ends the proof for this VM; see vm_verify.c */
+    header.resume_verified = vm->resume_verified && vm->code_verified;
+    header.memory_offset = round_to_page(sizeof(header));
+    header.stack_offset = header.memory_offset + round_to_page(vm->memory_size);
+
+    unsigned char *area;
+    size_t area_length = vm_guard_stack_area(vm, &area);
+    off_t stack_start = header.stack_offset + ((unsigned char*)vm->stack - area);
+    header.frames_offset = header.stack_offset + area_length;
+    struct vm_frame_record *frames = vm_frames_save(vm, &header.frame_count);
+    if (!frames) {
+        return 0;
+    }
+
+    char *temp;
+    int fd = create_temp(filename, &temp);
+    if (fd == -1) {
+        free(frames);
+        return 0;
+    }
+    int ok = ftruncate(fd, header.stack_offset + area_length) == 0
+          && vm_write_all(fd, &header, sizeof(header), 0)
+          && vm_write_sparse(fd, vm->fixed_memory, vm->memory_size, header.memory_offset)
+          && vm_write_all(fd, vm->stack, header.stack_depth * sizeof(int), stack_start)
+          && vm_write_all(fd, frames, header.frame_count * sizeof(struct vm_frame_record),
+                          header.frames_offset);
+    ok = close(fd) == 0 && ok;
+    free(frames);
+    if (!replace_file(temp, filename, ok)) {
+        return 0;
+    }
+    clear_dirty(vm);
+    return 1;
+}
+
+static int header_valid(const struct snapshot_header *header, off_t file_size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) == 0
+        && header->version == SNAPSHOT_VERSION
+        && header->page_size == page
+        && header->memory_offset % page == 0
+        && header->stack_offset % page == 0
+        && header->memory_offset >= sizeof(*header)
+        && header->stack_offset >= header->memory_offset + header->memory_size
+        && header->stack_offset <= (uint64_t)file_size
+        && header->stack_size > 0
+        && header->stack_size % sizeof(int) == 0
+        && header->stack_depth <= header->stack_size / sizeof(int)
+        && header->frame_count > 0
+        && header->frames_offset >= header->stack_offset
+        && header->frames_offset + (uint64_t)header->frame_count
+                                   * sizeof(struct vm_frame_record) <= (uint64_t)file_size;
+}
+
+/* Does for vm_restore what vm_guard_init_file does for vm_init_file, and
+ * sets the stack pointer and resume point as well. The return stack is
+ * read into *frames, a new array of *frame_count records, for vm_restore
+ * to give vm_frames_load once the rest of the VM is set up. */
+int vm_snapshot_map(struct vmstate *vm, const char *filename,
+                    struct vm_frame_record **frames, unsigned *frame_count) {
+    struct snapshot_header header;
+    struct stat info;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        return 0;
+    }
+    if (fstat(fd, &info) != 0
+            || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+            || !header_valid(&header, info.st_size)) {
+        close(fd);
+        return 0;
+    }
+    size_t frames_size = header.frame_count * sizeof(struct vm_frame_record);
+    *frames = malloc(frames_size);
+    if (!*frames || pread(fd, *frames, frames_size, header.frames_offset)
+                    != (ssize_t)frames_size) {
+        free(*frames);
+        close(fd);
+        return 0;
+    }
+    *frame_count = header.frame_count;
+    vm->memory_size = header.memory_size;
+    if (!vm_guard_init_fd(vm, fd, header.memory_offset, header.memory_size,
+                          header.stack_size)) {
+        free(*frames);
+        close(fd);
+        return 0;
+    }
+    unsigned char *area;
+    size_t area_length = vm_guard_stack_area(vm, &area);
+    /* mapping past the end of the file would fault on first touch */
+    if (header.stack_offset + area_length > (uint64_t)info.st_size
+            || !vm_guard_map_stack(vm, fd, header.stack_offset)) {
+        vm_guard_free(vm);
+        free(*frames);
+        close(fd);
+        return 0;
+    }
+    close(fd);
+
+    vm->stack_ptr = vm->stack + header.stack_depth;
+    vm->resume_pc = header.resume_pc;
+    vm->resume_verified = header.resume_verified;
+    return 1;
+}
+
+/* ************************************************************************* *
+ * CHECKPOINTS                                                               *
+ * ************************************************************************* */
+/* Writes the blocks of memory marked in blocks, the stack and the return
+ * stack after header; block_count is filled in here. */
+static int write_checkpoint(const char *filename, struct checkpoint_header *header,
+                            const unsigned char *memory, const unsigned char *blocks,
+                            const int *stack, const struct vm_frame_record *frames) {
+    unsigned count = block_count(header->memory_size);
+    header->block_count = 0;
+    for (unsigned block = 0; block < count; ++block) {
+        header->block_count += blocks[block] != 0;
+    }
+
+    char *temp;
+    int fd = create_temp(filename, &temp);
+    if (fd == -1) {
+        return 0;
+    }
+    FILE *out = fdopen(fd, "wb");
+    if (!out) {
+        close(fd);
+        return replace_file(temp, filename, 0);
+    }
+    int ok = fwrite(header, sizeof(*header), 1, out) == 1;
+    for (unsigned block = 0; ok && block < count; ++block) {
+        if (blocks[block]) {
+            uint32_t index = block;
+            ok = fwrite(&index, sizeof(index), 1, out) == 1
+              && fwrite(&memory[(size_t)block << VM_DIRTY_SHIFT],
+                        block_length(header->memory_size, block), 1, out) == 1;
+        }
+    }
+    ok = ok && fwrite(stack, sizeof(int), header->stack_depth, out) == header->stack_depth;
+    ok = ok && fwrite(frames, sizeof(struct vm_frame_record), header->frame_count, out)
+               == header->frame_count;
+    ok = fclose(out) == 0 && ok;
+    return replace_file(temp, filename, ok);
+}
+
+int vm_checkpoint(struct vmstate *vm, const char *filename) {
+    if (!vm->resumable) {
+        return 0;
+    }
+    vm_flush_output(vm);
+
+    struct checkpoint_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.version = CHECKPOINT_VERSION;
+    header.memory_size = vm->memory_size;
+    header.block_size = VM_DIRTY_BLOCK;
+    header.stack_size = vm->stack_size;
+    header.stack_depth = vm->stack_ptr - vm->stack;
+    header.resume_pc = vm->resume_pc;
+    header.resume_verified = vm->resume_verified && vm->code_verified;
+    struct vm_frame_record *frames = vm_frames_save(vm, &header.frame_count);
+    int ok = frames && write_checkpoint(filename, &header, vm->fixed_memory, vm->dirty,
+                                        vm->stack, frames);
+    free(frames);
+    if (!ok) {
+        return 0;
+    }
+    clear_dirty(vm);
+    return 1;
+}
+
+static int read_checkpoint_header(FILE *in, struct checkpoint_header *header) {
+    return fread(header, sizeof(*header), 1, in) == 1
+        && memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) == 0
+        && header->version == CHECKPOINT_VERSION
+        && header->block_size == VM_DIRTY_BLOCK
+        && header->block_count <= block_count(header->memory_size)
+        && header->stack_size > 0
+        && header->stack_size % sizeof(int) == 0
+        && header->stack_depth <= header->stack_size / sizeof(int)
+        && header->frame_count > 0
+        && header->frame_count <= header->stack_size / sizeof(int);
+}
+
+/* A new array of the header's frame_count return stack records. */
+static struct vm_frame_record* read_frames(FILE *in, const struct checkpoint_header *header) {
+    struct vm_frame_record *frames = malloc(header->frame_count
+                                            * sizeof(struct vm_frame_record));
+    if (frames && fread(frames, sizeof(struct vm_frame_record), header->frame_count, in)
+                  != header->frame_count) {
+        free(frames);
+        return NULL;
+    }
+    return frames;
+}
+
+/* Reads the next block record into its place in memory, which holds
+ * memory_size bytes, and returns its index or -1. */
+static long read_block(FILE *in, unsigned char *memory, unsigned memory_size) {
+    uint32_t index;
+    if (fread(&index, sizeof(index), 1, in) != 1 || index >= block_count(memory_size)) {
+        return -1;
+    }
+    unsigned length = block_length(memory_size, index);
+    if (fread(&memory[(size_t)index << VM_DIRTY_SHIFT], length, 1, in) != 1) {
+        return -1;
+    }
+    return index;
+}
+
+/* The VM must have the memory size and stack size the checkpoint was made
+ * with. One that fails partway through has a mix of old and new memory and
+ * should be freed. */
+int vm_apply_checkpoint(struct vmstate *vm, const char *filename) {
+    struct checkpoint_header header;
+    FILE *in = fopen(filename, "rb");
+    if (!in) {
+        return 0;
+    }
+    int ok = read_checkpoint_header(in, &header)
+          && header.memory_size == vm->memory_size
+          && header.stack_size == vm->stack_size;
+    for (unsigned i = 0; ok && i < header.block_count; ++i) {
+        long block = read_block(in, vm->fixed_memory, vm->memory_size);
+        ok = block >= 0;
+        if (ok) {
+            /* throws away whatever was decoded or verified there */
+            vm_invalidate(vm, block << VM_DIRTY_SHIFT, block_length(vm->memory_size, block));
+        }
+    }
+    ok = ok && fread(vm->stack, sizeof(int), header.stack_depth, in) == header.stack_depth;
+    struct vm_frame_record *frames = ok ? read_frames(in, &header) : NULL;
+    fclose(in);
+    if (!frames) {
+        return 0;
+    }
+    vm->stack_ptr = vm->stack + header.stack_depth;
+    ok = vm_frames_load(vm, frames, header.frame_count);
+    free(frames);
+    if (!ok) {
+        return 0;
+    }
+    vm->resume_pc = header.resume_pc;
+    vm->resume_verified = header.resume_verified;
+    vm->resumable = 1;
+    return 1;
+}
+
+/* Merges a chain of checkpoints, oldest first, into one that has the same
+ * effect: the newest copy of every block and the last stack. */
+int vm_compact_checkpoints(const char *filename, const char *const *chain,
+                           unsigned count) {
+    struct checkpoint_header header, next;
+    unsigned char *memory = NULL, *blocks = NULL;
+    int *stack = NULL;
+    struct vm_frame_record *frames = NULL;
+    int ok = count > 0;
+
+    for (unsigned i = 0; ok && i < count; ++i) {
+        FILE *in = fopen(chain[i], "rb");
+        ok = in && read_checkpoint_header(in, &next);
+        if (ok && i == 0) {
+            header = next;
+            memory = malloc(header.memory_size ? header.memory_size : 1);
+            blocks = calloc(block_count(header.memory_size) + 1, 1);
+            ok = memory && blocks;
+        }
+        ok = ok && next.memory_size == header.memory_size;
+        if (ok && next.stack_size != header.stack_size) {
+            free(stack);
+            stack = NULL;
+        }
+        if (ok && !stack) {
+            stack = malloc(next.stack_size);
+            ok = stack != NULL;
+        }
+        for (unsigned j = 0; ok && j < next.block_count; ++j) {
+            long block = read_block(in, memory, header.memory_size);
+            ok = block >= 0;
+            if (ok) {
+                blocks[block] = 1;
+            }
+        }
+        ok = ok && fread(stack, sizeof(int), next.stack_depth, in) == next.stack_depth;
+        if (ok) {
+            free(frames);
+            frames = read_frames(in, &next);
+            ok = frames != NULL;
+        }
+        if (ok) {
+            header = next;
+        }
+        if (in) {
+            fclose(in);
+        }
+    }
+    ok = ok && write_checkpoint(filename, &header, memory, blocks, stack, frames);
+    free(memory);
+    free(blocks);
+    free(stack);
+    free(frames);
+    return ok;
+}
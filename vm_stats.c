@@ -0,0 +1,61 @@
+#define _POSIX_C_SOURCE 200112L
+#include <stdlib.h>
+#include <string.h>
+
+#include "toyvm.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * STATISTICS                                                                *
+ * ************************************************************************* *
+ * Every VM counts what it does in a struct vm_stats as it runs. Most
+ * counters go up as things happen: calls and returns in vm_push_frame and
+ * vm_pop_frame, I/O in the vm_io_* operations, memory traffic in the
+ * handlers and JIT templates that read and store. The instruction count
+ * is kept in a register instead (a local in vm_run, rbp in compiled code)
+ * and added in at every backward branch and call and on leaving, so it is
+ * never more than a loop iteration behind. The peak stack depth is only
+ * checked at calls and when the VM stops running, so it catches how deep
+ * calls nest but not what a loop pushes and pops again in between; doing
+ * it at every backward branch as well made tight loops a third slower.
+ *
+ * The counters have a cache line of their own, so a monitoring thread
+ * calling vm_get_stats only ever shares that line with the VM, never the
+ * ones holding the stack pointer, budget and the rest of the VM's state.
+ * Each counter is read atomically, but not all of them at once.
+ *
+ * Measured on a tight load/store loop and a call-heavy loop, counting costs
+ * the threaded interpreters 3-5% and is lost in the noise for the switch
+ * interpreter and the JIT.
+ */
+#define STATS_CACHE_LINE    64
+
+int vm_stats_init(struct vmstate *vm) {
+    size_t size = (sizeof(struct vm_stats) + STATS_CACHE_LINE - 1)
+                & ~(size_t)(STATS_CACHE_LINE - 1);
+    void *stats;
+    if (posix_memalign(&stats, STATS_CACHE_LINE, size) != 0) {
+        return 0;
+    }
+    memset(stats, 0, size);
+    vm->stats = stats;
+    return 1;
+}
+
+void vm_stats_free(struct vmstate *vm) {
+    free(vm->stats);
+    vm->stats = NULL;
+}
+
+struct vm_stats vm_get_stats(struct vmstate *vm) {
+    const struct vm_stats *live = vm->stats;
+    struct vm_stats stats;
+    stats.instructions = __atomic_load_n(&live->instructions, __ATOMIC_RELAXED);
+    stats.calls = __atomic_load_n(&live->calls, __ATOMIC_RELAXED);
+    stats.returns = __atomic_load_n(&live->returns, __ATOMIC_RELAXED);
+    stats.bytes_read = __atomic_load_n(&live->bytes_read, __ATOMIC_RELAXED);
+    stats.bytes_written = __atomic_load_n(&live->bytes_written, __ATOMIC_RELAXED);
+    stats.io_ops = __atomic_load_n(&live->io_ops, __ATOMIC_RELAXED);
+    stats.max_stack_depth = __atomic_load_n(&live->max_stack_depth, __ATOMIC_RELAXED);
+    return stats;
+}
@@ -0,0 +1,466 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "toyvm.h"
+#include "opcode.h"
+#include "vm_internal.h"
+
+/* ************************************************************************* *
+ * BYTECODE VERIFIER                                                         *
+ * ************************************************************************* *
+ * vm_verify follows every path through a function and through everything it
+ * calls, tracking the stack depth relative to the function's frame and
+ * whether the top of the stack is a constant from a push. A function is
+ * accepted when:
+ *
+ *  - every instruction on every path is a known opcode that lies inside
+ *    memory, so execution can never run off the end;
+ *  - no instruction pops more than the function itself has pushed, so it
+ *    can never underflow the stack or touch its caller's frame;
+ *  - every path reaching an address gets there with the same depth, so the
+ *    depth at each instruction, and its maximum, are fixed;
+ *  - every call, tailcall and branch takes its target from a constant
+ *    push or from its own operand, and that target is inside memory;
+ *  - getlocal and setlocal only name locals the function has pushed, and
+ *    every call leaves the callee at least as many arguments as its
+ *    getarg and setarg name; and
+ *  - every function it calls is accepted too.
+ *
+ * Verified code runs in vm_execute_verified, which makes none of these
+ * checks and only checks for room on the stack once per call, using the
+ * callee's maximum depth. Any store into verified code clears
+ * vm->code_verified and sends execution back to the checked vm_execute.
+ */
+
+struct verifier {
+    struct vmstate *vm;
+
+    /* per address state for the function being checked */
+    int *depth;                 /* depth + 1, or 0 if not reached yet */
+    unsigned *top;              /* value of a constant on top of the stack */
+    unsigned char *top_known;
+
+    /* addresses reached by each function, for resetting and marking */
+    unsigned *reached;
+    unsigned reached_count, reached_capacity;
+    unsigned *work;
+    unsigned work_count, work_capacity;
+
+    /* functions found so far, where their reached addresses start, and
+     * calls between them as (caller index, callee address, arguments)
+     * triples, the last being what the caller has pushed for the callee */
+    unsigned *funcs;
+    unsigned func_count, func_capacity;
+    unsigned *func_first;
+    unsigned first_count, first_capacity;
+    unsigned *calls;
+    unsigned call_count, call_capacity;
+};
+
+static int append(unsigned **array, unsigned *count, unsigned *capacity, unsigned value) {
+    if (*count == *capacity) {
+        unsigned new_capacity = *capacity ? *capacity * 2 : 64;
+        unsigned *new_array = realloc(*array, new_capacity * sizeof(unsigned));
+        if (!new_array) return 0;
+        *array = new_array;
+        *capacity = new_capacity;
+    }
+    (*array)[(*count)++] = value;
+    return 1;
+}
+
+/* The length of a getlocal, setlocal, getarg or setarg at address with its
+ * number in *value, or 0 if there is none there. */
+static int frame_length(struct vmstate *vm, unsigned address, unsigned *value) {
+    const unsigned char *code = &vm->fixed_memory[address];
+    if (*code != op_getlocal && *code != op_setlocal
+            && *code != op_getarg && *code != op_setarg) {
+        return 0;
+    }
+    if (2 > vm->memory_size - address) {
+        return 0;
+    }
+    *value = code[1];
+    return 2;
+}
+
+/* Records that address is reached with the given state. Returns 0 if it
+ * was already reached with a different depth. */
+static int reach(struct verifier *v, unsigned address, int depth,
+                 int top_known, unsigned top) {
+    if (address >= v->vm->memory_size) {
+        return 0;
+    }
+    if (!v->depth[address]) {
+        v->depth[address] = depth + 1;
+        v->top_known[address] = top_known;
+        v->top[address] = top;
+        return append(&v->reached, &v->reached_count, &v->reached_capacity, address)
+            && append(&v->work, &v->work_count, &v->work_capacity, address);
+    }
+    if (v->depth[address] != depth + 1) {
+        return 0;
+    }
+    if (v->top_known[address] && (!top_known || v->top[address] != top)) {
+        v->top_known[address] = 0;
+        return append(&v->work, &v->work_count, &v->work_capacity, address);
+    }
+    return 1;
+}
+
+/* Checks the body of one function, without looking into its callees. */
+static int check_function(struct verifier *v, unsigned index) {
+    struct vmstate *vm = v->vm;
+    struct vm_function *func = &vm->functions[v->funcs[index]];
+    int capacity = vm->stack_size / sizeof(int);
+    int max_depth = 0;
+
+    func->returns = 0;
+    func->args = 0;
+    v->work_count = 0;
+    if (!reach(v, v->funcs[index], 0, 0, 0)) {
+        return 0;
+    }
+
+    while (v->work_count > 0) {
+        unsigned address = v->work[--v->work_count];
+        int depth = v->depth[address] - 1;
+        int top_known = v->top_known[address];
+        unsigned top = v->top[address];
+        unsigned value;
+        int length = 1, needs = 0, ends = 0;
+        int after = depth;
+        int after_known = 0;
+        unsigned after_top = 0;
+
+        switch (vm->fixed_memory[address]) {
+            case op_exit:
+                ends = 1;
+                break;
+            case op_stkdup:
+                needs = 1;
+                after = depth + 1;
+                after_known = top_known;
+                after_top = top;
+                break;
+            case op_pushb:
+            case op_pushs:
+            case op_pushw:
+            case op_push0:
+            case op_push1:
+            case op_pushm1:
+            case op_pushnl:
+            case op_pushv:
+                length = vm_push_length(vm, address, &value);
+                if (!length) return 0;
+                after = depth + 1;
+                after_known = 1;
+                after_top = value;
+                break;
+            case op_readb:
+            case op_reads:
+            case op_readw:
+            case op_inc:
+            case op_dec:
+                needs = 1;
+                break;
+            case op_storeb:
+            case op_stores:
+            case op_storew:
+            case op_gets:
+                needs = 2;
+                after = depth - 2;
+                break;
+            case op_add:
+            case op_sub:
+            case op_mul:
+            case op_div:
+            case op_mod:
+                needs = 2;
+                after = depth - 1;
+                break;
+            case op_saynum:
+            case op_saychar:
+            case op_saystr:
+                needs = 1;
+                after = depth - 1;
+                break;
+            case op_memcpy:
+            case op_memset:
+                needs = 3;
+                after = depth - 3;
+                break;
+            case op_memcmp:
+            case op_memchr:
+                needs = 3;
+                after = depth - 2;
+                break;
+            case op_call:
+            case op_tailcall:
+                /* the target is replaced by the return value; a tail call
+                 * returns from this function, as a call then ret would */
+                needs = 1;
+                if (vm->fixed_memory[address] == op_tailcall) {
+                    ends = 1;
+                    func->returns = 1;
+                }
+                if (!top_known || top >= vm->memory_size) return 0;
+                if (!append(&v->calls, &v->call_count, &v->call_capacity, index)
+                        || !append(&v->calls, &v->call_count, &v->call_capacity, top)
+                        || !append(&v->calls, &v->call_count, &v->call_capacity,
+                                   depth > 0 ? depth - 1 : 0)) {
+                    return 0;
+                }
+                break;
+            case op_ret:
+                needs = 1;
+                ends = 1;
+                func->returns = 1;
+                break;
+            case op_jump:
+            case op_jumprel:
+                needs = 1;
+                ends = 1;
+                if (!top_known || depth < needs) return 0;
+                value = vm->fixed_memory[address] == op_jump ? top : address + top;
+                if (!reach(v, value, depth - 1, 0, 0)) return 0;
+                break;
+            case op_jz:
+            case op_jnz:
+                needs = 2;
+                after = depth - 2;
+                if (!top_known || depth < needs) return 0;
+                if (!reach(v, top, after, 0, 0)) return 0;
+                break;
+            case op_jump8:
+            case op_jump16:
+                length = vm_branch_length(vm, address, &value);
+                if (!length) return 0;
+                ends = 1;
+                if (!reach(v, value, depth, top_known, top)) return 0;
+                break;
+            case op_jz8:
+            case op_jz16:
+            case op_jnz8:
+            case op_jnz16:
+                length = vm_branch_length(vm, address, &value);
+                if (!length) return 0;
+                needs = 1;
+                after = depth - 1;
+                if (depth < needs) return 0;
+                if (!reach(v, value, after, 0, 0)) return 0;
+                break;
+            case op_getlocal:
+                length = frame_length(vm, address, &value);
+                if (!length) return 0;
+                needs = value + 1;
+                after = depth + 1;
+                break;
+            case op_setlocal:
+                length = frame_length(vm, address, &value);
+                if (!length) return 0;
+                needs = value + 2;
+                after = depth - 1;
+                break;
+            case op_getarg:
+            case op_setarg:
+                length = frame_length(vm, address, &value);
+                if (!length) return 0;
+                if (value >= func->args) func->args = value + 1;
+                if (vm->fixed_memory[address] == op_getarg) {
+                    after = depth + 1;
+                } else {
+                    needs = 1;
+                    after = depth - 1;
+                }
+                break;
+            default:
+                return 0;
+        }
+
+        if (depth < needs) {
+            return 0;
+        }
+        if (after > max_depth) {
+            max_depth = after;
+            if (max_depth > capacity || max_depth > 0xFFFF) return 0;
+        }
+        if (!ends && !reach(v, address + length, after, after_known, after_top)) {
+            return 0;
+        }
+    }
+
+    func->depth = max_depth;
+    return 1;
+}
+
+static int verify_entry(struct verifier *v, unsigned entry) {
+    struct vmstate *vm = v->vm;
+    int ok = 1, changed;
+
+    if (vm->functions[entry].status != vm_function_unknown) {
+        return vm->functions[entry].status == vm_function_verified;
+    }
+
+    v->func_count = v->first_count = v->call_count = v->reached_count = 0;
+    if (!append(&v->funcs, &v->func_count, &v->func_capacity, entry)) {
+        return 0;
+    }
+    vm->functions[entry].status = vm_function_pending;
+
+    for (unsigned i = 0; ok && i < v->func_count; ++i) {
+        unsigned first_call = v->call_count;
+        unsigned first = v->reached_count;
+
+        if (!append(&v->func_first, &v->first_count, &v->first_capacity, first)) {
+            ok = 0;
+            break;
+        }
+        if (!check_function(v, i)) {
+            vm->functions[v->funcs[i]].status = vm_function_rejected;
+        }
+        for (unsigned j = first; j < v->reached_count; ++j) {
+            v->depth[v->reached[j]] = 0;
+        }
+
+        /* queue callees that have not been seen before */
+        for (unsigned j = first_call; ok && j < v->call_count; j += 3) {
+            unsigned callee = v->calls[j + 1];
+            if (vm->functions[callee].status == vm_function_unknown) {
+                vm->functions[callee].status = vm_function_pending;
+                ok = append(&v->funcs, &v->func_count, &v->func_capacity, callee);
+            }
+        }
+    }
+    if (!append(&v->func_first, &v->first_count, &v->first_capacity, v->reached_count)) {
+        ok = 0;
+    }
+
+    /* a function calling one that was rejected, or without pushing the
+     * arguments it uses, is rejected as well */
+    do {
+        changed = 0;
+        for (unsigned j = 0; j < v->call_count; j += 3) {
+            struct vm_function *caller = &vm->functions[v->funcs[v->calls[j]]];
+            struct vm_function *callee = &vm->functions[v->calls[j + 1]];
+            if (caller->status != vm_function_rejected
+                    && (callee->status == vm_function_rejected
+                        || callee->args > v->calls[j + 2])) {
+                caller->status = vm_function_rejected;
+                changed = 1;
+            }
+        }
+    } while (changed);
+
+    for (unsigned i = 0; i < v->func_count; ++i) {
+        struct vm_function *func = &vm->functions[v->funcs[i]];
+        if (func->status != vm_function_pending) continue;
+        if (!ok) {
+            func->status = vm_function_rejected;
+            continue;
+        }
+        func->status = vm_function_verified;
+        for (unsigned j = v->func_first[i]; j < v->func_first[i + 1]; ++j) {
+            unsigned address = v->reached[j], value;
+            int length = vm_push_length(vm, address, &value);
+            if (!length) length = frame_length(vm, address, &value);
+            if (!length) length = vm_branch_length(vm, address, &value);
+            if (!length) length = 1;
+            for (int k = 0; k < length; ++k) {
+                vm->code_marks[address + k] |= VM_MARK_VERIFIED;
+            }
+        }
+    }
+    return vm->functions[entry].status == vm_function_verified;
+}
+
+static int verifier_init(struct verifier *v, struct vmstate *vm) {
+    memset(v, 0, sizeof(struct verifier));
+    v->vm = vm;
+    /* calloc, so the pages of a large image that verification never
+     * reaches are never touched */
+    v->depth = calloc(vm->memory_size, sizeof(int));
+    v->top = malloc(vm->memory_size * sizeof(unsigned));
+    v->top_known = malloc(vm->memory_size);
+    if (!v->depth || !v->top || !v->top_known) {
+        free(v->depth);
+        free(v->top);
+        free(v->top_known);
+        return 0;
+    }
+    return 1;
+}
+
+static void verifier_free(struct verifier *v) {
+    free(v->depth);
+    free(v->top);
+    free(v->top_known);
+    free(v->reached);
+    free(v->work);
+    free(v->funcs);
+    free(v->func_first);
+    free(v->calls);
+}
+
+
+int vm_verify_init(struct vmstate *vm) {
+    vm->functions = calloc(vm->memory_size, sizeof(struct vm_function));
+    vm->code_verified = 1;
+    return vm->functions != NULL || vm->memory_size == 0;
+}
+
+void vm_verify_free(struct vmstate *vm) {
+    free(vm->functions);
+    vm->functions = NULL;
+}
+
+/* Verifies every exported address that looks like code, before anything
+ * runs. Exports that are data are simply rejected. */
+void vm_verify_exports(struct vmstate *vm) {
+    struct verifier v;
+    if (vm->memory_size < EXPORT_FIRST || !verifier_init(&v, vm)) {
+        return;
+    }
+    unsigned export_count = vm_read_word(vm, EXPORT_COUNT_POS);
+    for (unsigned i = 0; i < export_count; ++i) {
+        unsigned pos = EXPORT_FIRST + i * EXPORT_SIZE + EXPORT_NAME_SIZE;
+        if (pos + 4 > vm->memory_size) break;
+        unsigned address = vm_read_word(vm, pos);
+        if (address < vm->memory_size) {
+            verify_entry(&v, address);
+        }
+    }
+    verifier_free(&v);
+}
+
+/* Forgets every function verified or rejected so far, along with the code
+ * marked as verified, and verifies the exports again; for when the stack
+ * their depths were checked against is replaced. */
+void vm_verify_reset(struct vmstate *vm) {
+    for (unsigned address = 0; address < vm->memory_size; ++address) {
+        if (vm->functions[address].status != vm_function_unknown) {
+            memset(&vm->functions[address], 0, sizeof(struct vm_function));
+        }
+        if (vm->code_marks[address] & VM_MARK_VERIFIED) {
+            vm->code_marks[address] &= ~VM_MARK_VERIFIED;
+        }
+    }
+    vm_verify_exports(vm);
+}
+
+/* Returns nonzero if the function at address can run in
+ * vm_execute_verified. */
+int vm_verify(struct vmstate *vm, unsigned address) {
+    struct verifier v;
+    if (address >= vm->memory_size || !vm->code_verified) {
+        return 0;
+    }
+    if (vm->functions[address].status == vm_function_unknown) {
+        if (!verifier_init(&v, vm)) {
+            return 0;
+        }
+        verify_entry(&v, address);
+        verifier_free(&v);
+    }
+    return vm->functions[address].status == vm_function_verified;
+}
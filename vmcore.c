@@ -1,227 +1,429 @@
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "toyvm.h"
 #include "opcode.h"
+#include "vm_internal.h"
 
-#define EXPORT_COUNT_POS    12
-#define EXPORT_FIRST        16
-#define EXPORT_NAME_SIZE    16
-#define EXPORT_SIZE         20
-
-static inline void vm_stk_push(struct vmstate *vm, int value) {
-    *vm->stack_ptr = value;
-    ++vm->stack_ptr;
-}
-static inline int vm_stk_size(struct vmstate *vm) {
-    return vm->stack_ptr - vm->stack;
-}
-static inline int vm_stk_peek(struct vmstate *vm, int pos) {
-    return *(vm->stack_ptr - pos);
-}
-static inline int vm_stk_pop(struct vmstate *vm) {
-    --vm->stack_ptr;
-    return *vm->stack_ptr;
-}
-static inline void vm_stk_set(struct vmstate *vm, int pos, int val) {
-    *(vm->stack_ptr - pos) = val;
-}
 
+/* Stack checks. Underflow is only checked in vm_execute; vm_execute_verified
+ * runs code that vm_verify has shown cannot underflow its frame. Running
+ * off the top of the stack faults on a guard page (see vm_guard.c), which
+ * reports vm->pc, so handlers record it before anything that may fault. */
+#define STACK_CAPACITY(vm)  ((int)((vm)->stack_size / sizeof(int)))
 #define MIN_STACK(vm, min_size) \
-    if (vm_stk_size(vm) < min_size) { \
+    if (VM_CHECKED && STACK_DEPTH() < min_size) { \
         fprintf(stderr, "stack underflow\n"); \
-        return 0; \
+        VM_RETURN(0); \
+    }
+#define FAULT_PC()          (vm->pc = ip - vm->code)
+/* for superinstructions, the opcode at the end that does the access */
+#define FAULT_PC_LAST()     (vm->pc = ip - vm->code + ip->length - 1)
+/* calls and returns move vm->pc into the function now running, for
+ * vm_sample.c; whatever faults next records its own address first */
+#define SAMPLE_PC(address)  (vm->pc = (address))
+/* verified code never pushes past the room FRAME_ROOM found for it */
+#define PUSH_PC()           do { if (VM_CHECKED) FAULT_PC(); } while (0)
+/* verified code checks for room for the callee's whole frame up front */
+#define FRAME_ROOM(vm, target) \
+    if (VM_CHECKED) { \
+        FAULT_PC(); \
+    } else if (STACK_DEPTH() > STACK_CAPACITY(vm) - (vm)->functions[target].depth) { \
+        fprintf(stderr, "Instruction at 0x%08lX overflowed the stack.\n", \
+                (unsigned long)(ip - vm->code + ip->length - 1)); \
+        VM_RETURN(0); \
+    }
+/* a new frame on the return stack for a call to target; see vm_frames.c */
+#define PUSH_FRAME(vm, target) \
+    if (!vm_push_frame(vm, target, ip - vm->code + ip->length)) { \
+        fprintf(stderr, "Instruction at 0x%08lX overflowed the call stack.\n", \
+                (unsigned long)(ip - vm->code + ip->length - 1)); \
+        VM_RETURN(0); \
     }
+/* only checked code can get to a ret with no call to return from */
+#define HAS_CALLER(vm) \
+    if (VM_CHECKED && !(vm)->call_frame->prev) { \
+        fprintf(stderr, "Instruction at 0x%08lX returned with no call to return from.\n", \
+                (unsigned long)(ip - vm->code)); \
+        VM_RETURN(0); \
+    }
+/* getframe and setframe: the entry at frame_ptr[slot] has to be on the
+ * stack, under the top above entries. vm_verify has already shown verified
+ * code only names entries that its frame or its caller pushed. */
+#define FRAME_SLOT(vm, slot, above) \
+    if (VM_CHECKED && (unsigned long)((vm)->frame_ptr - (vm)->stack + (slot)) \
+                      >= (unsigned long)STACK_DEPTH() - (above)) { \
+        fprintf(stderr, "stack underflow\n"); \
+        VM_RETURN(0); \
+    }
+
 
+/* Everything but the memory and stack, which vm_guard.c sets up. An image
+ * made by vm_image_create brings its decoded and verified code along. */
+static int init_state(struct vmstate *vm, const struct vm_image *image) {
+    vm->jit = NULL;
+    vm->pc = 0;
+    vm->resumable = 0;
+    vm->stop_requested = 0;
+    vm->input = NULL;
+    vm->state_mapped = 0;
+    vm->profile = NULL;
 
+    if (!vm_stats_init(vm)) {
+        vm_guard_free(vm);
+        return 0;
+    }
+    if (!vm_frames_init(vm)) {
+        vm_stats_free(vm);
+        vm_guard_free(vm);
+        return 0;
+    }
+    if (!vm_output_init(vm)) {
+        vm_frames_free(vm);
+        vm_stats_free(vm);
+        vm_guard_free(vm);
+        return 0;
+    }
+    if (!vm_export_init(vm)) {
+        vm_output_free(vm);
+        vm_frames_free(vm);
+        vm_stats_free(vm);
+        vm_guard_free(vm);
+        return 0;
+    }
+    if (!vm_dirty_init(vm)) {
+        vm_export_free(vm);
+        vm_output_free(vm);
+        vm_frames_free(vm);
+        vm_stats_free(vm);
+        vm_guard_free(vm);
+        return 0;
+    }
+    if (image) {
+        if (!vm_image_map_state(vm, image)) {
+            vm_dirty_free(vm);
+            vm_export_free(vm);
+            vm_output_free(vm);
+            vm_frames_free(vm);
+            vm_stats_free(vm);
+            vm_guard_free(vm);
+            return 0;
+        }
+        return 1;
+    }
+    if (!vm_decode_init(vm)) {
+        vm_dirty_free(vm);
+        vm_export_free(vm);
+        vm_output_free(vm);
+        vm_frames_free(vm);
+        vm_stats_free(vm);
+        vm_guard_free(vm);
+        return 0;
+    }
+    if (!vm_verify_init(vm)) {
+        vm_decode_free(vm);
+        vm_dirty_free(vm);
+        vm_export_free(vm);
+        vm_output_free(vm);
+        vm_frames_free(vm);
+        vm_stats_free(vm);
+        vm_guard_free(vm);
+        return 0;
+    }
+    vm_verify_exports(vm);
+    return 1;
+}
+
+/* The image is copied into memory owned by the VM (see vm_guard.c), so
+ * memory_source can be freed once this returns. */
 int vm_init_memory(struct vmstate *vm, unsigned memory_size, unsigned char *memory_source) {
-    vm->fixed_memory = memory_source;
     vm->memory_size = memory_size;
+    if (!vm_guard_init(vm, memory_size, memory_source, VM_DEFAULT_STACK_SIZE)) {
+        return 0;
+    }
+    return init_state(vm, NULL);
+}
 
-    vm->frame_ptr = NULL;
-    vm->stack_size = 512;
-    vm->stack = malloc(vm->stack_size);
-    vm->stack_ptr = vm->stack;
-    return vm->stack != NULL;
+/* Maps the image straight from filename, privately, so its pages are only
+ * read in as they are touched and writes never reach the file. */
+int vm_init_file(struct vmstate *vm, const char *filename) {
+    if (!vm_guard_init_file(vm, filename, VM_DEFAULT_STACK_SIZE)) {
+        return 0;
+    }
+    return init_state(vm, NULL);
 }
 
-int vm_get_export(struct vmstate *vm, const char *name) {
-    int export_count = vm_read_word(vm, EXPORT_COUNT_POS);
-    for (int i = 0; i < export_count; ++i) {
-        int pos = EXPORT_FIRST + i * EXPORT_SIZE;
-        char export_name[20] = { 0 };
-        for (int j = 0; j < EXPORT_NAME_SIZE; ++j, ++pos) {
-            export_name[j] = vm->fixed_memory[pos];
-        }
-        if (strcmp(export_name, name) == 0) {
-            return vm_read_word(vm, pos);
-        }
+/* Shares the image, and the work of decoding and verifying it, with every
+ * other instance made from it; see vm_image.c. */
+int vm_init_image(struct vmstate *vm, const struct vm_image *image) {
+    if (!vm_image_map_memory(vm, image)) {
+        return 0;
     }
-    return -1;
+    return init_state(vm, image);
 }
 
-int vm_run(struct vmstate *vm, unsigned start_address) {
-    if (start_address >= vm->memory_size) {
+/* Sets up a VM from a file written by vm_snapshot, ready for vm_run_for to
+ * continue it where it left off; see vm_snapshot.c. */
+int vm_restore(struct vmstate *vm, const char *filename) {
+    struct vm_frame_record *frames;
+    unsigned frame_count;
+    if (!vm_snapshot_map(vm, filename, &frames, &frame_count)) {
         return 0;
     }
+    if (!init_state(vm, NULL)) {
+        free(frames);
+        return 0;
+    }
+    int ok = vm_frames_load(vm, frames, frame_count);
+    free(frames);
+    if (!ok) {
+        vm_free(vm);
+        return 0;
+    }
+    vm->resumable = 1;
+    return 1;
+}
+
+/* Replaces the (empty) stack with one of stack_size bytes. */
+int vm_set_stack_size(struct vmstate *vm, unsigned stack_size) {
+    if (vm->stack_ptr != vm->stack || !vm_guard_stack(vm, stack_size)) {
+        return 0;
+    }
+    /* how deep verified code may go was checked against the old stack */
+    vm_verify_reset(vm);
+    return 1;
+}
+
+/* ************************************************************************* *
+ * DISPATCH                                                                  *
+ * ************************************************************************* *
+ * vm_run executes the decoded entries in vm->code (see vm_decode.c) and is
+ * written in terms of the macros below so the same handler bodies can be
+ * dispatched either through a single switch statement or, when built with
+ * TOYVM_THREADED on a GCC-compatible compiler, through a table of label
+ * addresses with the dispatch replicated at the end of every handler.
+ */
+#if defined(TOYVM_THREADED) && defined(__GNUC__)
+#define VM_THREADED 1
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+/* toyvm-opcount reports every executed opcode to vm_opcount.c, and a
+ * PROFILE=1 build every dispatched entry to vm_profile.c */
+#ifdef TOYVM_OPCOUNT
+#define VM_TRACE() \
+    if (ip->xop != xop_decode && ip->xop != xop_outside) \
+        vm_opcount_record(&opcount_history, ip->xop)
+#elif defined(TOYVM_PROFILE)
+#define VM_TRACE() \
+    if (ip->xop != xop_decode && ip->xop != xop_outside) \
+        vm_profile_record(vm, ip - vm->code, ip->xop)
+#else
+#define VM_TRACE()
+#endif
+
+#ifdef VM_THREADED
+#define VM_DISPATCH_BEGIN   DISPATCH;
+#define VM_DISPATCH_END
+#define CASE(op)            do_##op:
+#define DISPATCH            do { VM_TRACE(); ++retired; goto *dispatch_table[ip->xop]; } while (0)
+#else
+#define VM_DISPATCH_BEGIN   dispatch: VM_TRACE(); ++retired; switch (ip->xop) {
+#define VM_DISPATCH_END     }
+#define CASE(op)            case op:
+#define DISPATCH            goto dispatch
+#endif
+
+/* advance past a single-byte instruction, or past one with operands */
+#define NEXT                do { ++ip; DISPATCH; } while (0)
+#define NEXT_LONG           do { ip += ip->length; DISPATCH; } while (0)
+
+/* transfer control to a bytecode address taken from the stack */
+#define JUMP(address) \
+    do { \
+        unsigned jump_to = (address); \
+        if (jump_to >= vm->memory_size) { \
+            vm_pc_error(vm, jump_to); \
+            VM_RETURN(0); \
+        } \
+        ip = &vm->code[jump_to]; \
+        DISPATCH; \
+    } while (0)
+
+/* a branch to an address taken from the stack; see CHECKPOINT below */
+#define BRANCH(address) \
+    do { \
+        if ((address) <= (unsigned)(ip - vm->code)) { \
+            /* not decoded ahead, so charge the distance in bytes */ \
+            CHECKPOINT((address), ip - vm->code - (address) + 1); \
+        } \
+        JUMP(address); \
+    } while (0)
 
-    unsigned opcode, operand, operand2;
-    unsigned char *pc = &vm->fixed_memory[start_address];
+/* Every dispatch counts one instruction in retired; a superinstruction
+ * adds the rest of the ones it covers, and a dispatch that only decodes
+ * takes its count back. retired goes into vm->stats at every CHECKPOINT
+ * and on leaving; see vm_stats.c. */
+#define RETIRED(count)      (retired += (count))
+#define FLUSH_RETIRED()     do { VM_STAT_ADD(stats->instructions, retired); retired = 0; } while (0)
+#define COUNT(counter, n)   VM_STAT_ADD(stats->counter, n)
+
+/* At backward branches and calls: charge cost to the budget (see
+ * vm_decode.c) and, once it has run out or vm_stop was called, return with
+ * everything in place for vm_run_for to continue at resume_at. */
+#define CHECKPOINT(resume_at, cost) \
+    do { \
+        FLUSH_RETIRED(); \
+        if ((budget -= (cost)) < 0 || vm_stop_requested(vm)) { \
+            vm->resume_pc = (resume_at); \
+            vm->resume_verified = !VM_CHECKED; \
+            vm->budget = budget; \
+            VM_RETURN(budget < 0 ? vm_status_paused : vm_status_stopped); \
+        } \
+    } while (0)
+
+/* ************************************************************************* *
+ * STACK ACCESS                                                              *
+ * ************************************************************************* *
+ * Handlers go through these macros rather than vm_stk_*. Built with
+ * TOYVM_TOS, vm_run keeps the stack pointer and the top stack entry in
+ * locals and only writes them back to vm->stack_ptr (SPILL) around calls,
+ * returns, I/O and on leaving vm_run; entries below the top are always in
+ * memory. Otherwise they operate on vm->stack_ptr directly.
+ */
+#ifdef TOYVM_TOS
+#define STACK_DEPTH()       (sp - vm->stack)
+#define TOP                 tos
+#define PUSH(v) \
+    do { \
+        int pushed = (v); \
+        sp[-1] = tos; \
+        tos = pushed; \
+        ++sp; \
+    } while (0)
+#define POP_TO(var)         do { (var) = tos; --sp; tos = sp[-1]; } while (0)
+/* before reading an entry that may be the top one through another pointer */
+#define SYNC_TOP()          (sp[-1] = tos)
+#define SPILL()             do { sp[-1] = tos; vm->stack_ptr = sp; } while (0)
+#define RELOAD()            do { sp = vm->stack_ptr; tos = sp[-1]; } while (0)
+#else
+#define STACK_DEPTH()       vm_stk_size(vm)
+#define TOP                 vm->stack_ptr[-1]
+#define PUSH(v)             vm_stk_push(vm, (v))
+#define POP_TO(var)         ((var) = vm_stk_pop(vm))
+#define SYNC_TOP()
+#define SPILL()
+#define RELOAD()
+#endif
+
+#define VM_RETURN(result)   do { SPILL(); FLUSH_RETIRED(); return (result); } while (0)
+
+void vm_pc_error(struct vmstate *vm, unsigned long address) {
+    fprintf(stderr,
+            "Tried to execute instruction at 0x%08lX which is outside memory sized 0x%08X\n",
+            address, vm->memory_size);
+}
+
+int vm_start(struct vmstate *vm, unsigned start_address) {
+    if (start_address >= vm->memory_size) {
+        return 0;
+    }
     vm->frame_ptr = vm->stack_ptr;
-    while (1) {
-        if (pc >= &vm->fixed_memory[vm->memory_size]) {
-            fprintf(stderr,
-                    "Tried to execute instruction at 0x%08lX which is outside memory sized 0x%08X\n",
-                    pc - vm->fixed_memory, vm->memory_size);
-            return 0;
-        }
+    vm_frames_reset(vm, start_address);
+    vm->resume_pc = start_address;
+    vm->resume_verified = vm_verify(vm, start_address)
+            && !vm->functions[start_address].returns
+            && !vm->functions[start_address].args
+            && vm_stk_size(vm) + vm->functions[start_address].depth
+               <= STACK_CAPACITY(vm);
+    vm->resumable = 1;
+    return 1;
+}
 
-        opcode = *pc++;
-        switch(opcode) {
-            case op_exit:
-                return 1;
-
-            case op_stkdup:
-                MIN_STACK(vm, 1);
-                vm_stk_push(vm, vm_stk_peek(vm, 1));
-                break;
-
-            case op_pushb:
-                vm_stk_push(vm, *pc++);
-                break;
-            case op_pushs:
-                operand = *pc++;
-                operand |= (*pc++) << 8;
-                vm_stk_push(vm, operand);
-                break;
-            case op_pushw:
-                operand = *pc++;
-                operand |= (*pc++) << 8;
-                operand |= (*pc++) << 16;
-                operand |= (*pc++) << 24;
-                vm_stk_push(vm, operand);
-                break;
-            case op_readb:
-                MIN_STACK(vm, 1);
-                vm_stk_push(vm, vm_read_byte(vm, vm_stk_pop(vm)));
-                break;
-            case op_reads:
-                MIN_STACK(vm, 1);
-                vm_stk_push(vm, vm_read_short(vm, vm_stk_pop(vm)));
-                break;
-            case op_readw:
-                MIN_STACK(vm, 1);
-                vm_stk_push(vm, vm_read_word(vm, vm_stk_pop(vm)));
-                break;
-            case op_storeb:
-                MIN_STACK(vm, 2);
-                operand = vm_stk_pop(vm);
-                vm_store_byte(vm, operand, vm_stk_pop(vm));
-                break;
-            case op_stores:
-                MIN_STACK(vm, 2);
-                operand = vm_stk_pop(vm);
-                vm_store_short(vm, operand, vm_stk_pop(vm));
-                break;
-            case op_storew:
-                MIN_STACK(vm, 2);
-                operand = vm_stk_pop(vm);
-                vm_store_word(vm, operand, vm_stk_pop(vm));
-                break;
-
-            case op_add:
-                MIN_STACK(vm, 2);
-                vm_stk_set(vm, 2, vm_stk_peek(vm, 2) + vm_stk_peek(vm, 1));
-                vm_stk_pop(vm);
-                break;
-            case op_sub:
-                MIN_STACK(vm, 2);
-                vm_stk_set(vm, 2, vm_stk_peek(vm, 2) - vm_stk_peek(vm, 1));
-                vm_stk_pop(vm);
-                break;
-            case op_mul:
-                MIN_STACK(vm, 2);
-                vm_stk_set(vm, 2, vm_stk_peek(vm, 2) * vm_stk_peek(vm, 1));
-                vm_stk_pop(vm);
-                break;
-            case op_div:
-                MIN_STACK(vm, 2);
-                vm_stk_set(vm, 2, vm_stk_peek(vm, 2) / vm_stk_peek(vm, 1));
-                vm_stk_pop(vm);
-                break;
-            case op_mod:
-                MIN_STACK(vm, 2);
-                vm_stk_set(vm, 2, vm_stk_peek(vm, 2) % vm_stk_peek(vm, 1));
-                vm_stk_pop(vm);
-                break;
-            case op_inc:
-                MIN_STACK(vm, 1);
-                vm_stk_set(vm, 1, vm_stk_peek(vm, 1) + 1);
-                break;
-            case op_dec:
-                MIN_STACK(vm, 1);
-                vm_stk_set(vm, 1, vm_stk_peek(vm, 1) - 1);
-                break;
-
-            case op_gets:
-                operand = vm_stk_pop(vm);
-                fgets((char*)&vm->fixed_memory[operand + 1], vm_stk_pop(vm), stdin);
-                operand2 = strlen((char*)&vm->fixed_memory[operand + 1]);
-                vm->fixed_memory[operand] = operand2;
-                vm->fixed_memory[operand + operand2] = 0;
-                break;
-            case op_saynum:
-                MIN_STACK(vm, 1);
-                printf("%d", vm_stk_pop(vm));
-                break;
-            case op_saychar:
-                MIN_STACK(vm, 1);
-                printf("%c", vm_stk_pop(vm));
-                break;
-            case op_saystr:
-                MIN_STACK(vm, 1);
-                printf("%s", &vm->fixed_memory[vm_stk_pop(vm)]);
-                break;
-
-            case op_call: {
-                MIN_STACK(vm, 1);
-                int target = vm_stk_pop(vm);
-                vm_stk_push(vm, pc - vm->fixed_memory);
-                vm_stk_push(vm, vm->frame_ptr - vm->stack);
-                pc = &vm->fixed_memory[target];
-                vm->frame_ptr = vm->stack_ptr;
-                break; }
-            case op_ret: {
-                MIN_STACK(vm, 1);
-                int retval = vm_stk_pop(vm);
-                vm->stack_ptr = vm->frame_ptr;
-                vm->frame_ptr = vm->stack + vm_stk_pop(vm);
-                pc = vm->fixed_memory + vm_stk_pop(vm);
-                vm_stk_push(vm, retval);
-                break; }
-
-            case op_jnz:
-                MIN_STACK(vm, 2);
-
-                if (vm_stk_peek(vm, 2) != 0) {
-                    pc = &vm->fixed_memory[vm_stk_peek(vm, 1)];
-                }
-                vm->stack_ptr -= 2;
-                break;
-
-            default:
-                fprintf(stderr,
-                        "Tried to execute unknown instruction 0x%X at address 0x%08lX.\n",
-                        opcode, pc - vm->fixed_memory);
-                return 0;
-        }
+/* Runs from vm->resume_pc with run, leaving the VM ready to continue if it
+ * was paused or stopped. vm->budget must already be set. */
+int vm_continue(struct vmstate *vm,
+                int (*run)(struct vmstate *vm, unsigned address)) {
+    if (!vm->resumable) {
+        return vm_status_error;
+    }
+    vm->resumable = 0;
+    if (vm->resume_pc >= vm->memory_size) {
+        /* paused on a call to a bad address */
+        vm_pc_error(vm, vm->resume_pc);
+        return vm_status_error;
     }
+#ifdef TOYVM_PROFILE
+    vm_profile_resume(vm);
+#endif
+    int status = vm_guarded_run(vm, run, vm->resume_pc);
+    vm_note_depth(vm);
+#ifdef TOYVM_PROFILE
+    vm_profile_pause(vm);
+#endif
+    if (status == vm_status_stopped) {
+        __atomic_store_n(&vm->stop_requested, 0, __ATOMIC_RELAXED);
+    }
+    vm->resumable = status == vm_status_paused || status == vm_status_stopped
+                 || status == vm_status_waiting;
+    return status;
+}
 
-    return 1;
+enum vm_status vm_run_for(struct vmstate *vm, unsigned long budget) {
+    vm->budget = budget > LONG_MAX ? LONG_MAX : (long)budget;
+    return vm_continue(vm, vm->resume_verified && vm->code_verified
+                           ? vm_execute_verified : vm_execute);
+}
+
+int vm_run(struct vmstate *vm, unsigned start_address) {
+    if (!vm_start(vm, start_address)) {
+        return 0;
+    }
+    return vm_run_for(vm, ULONG_MAX) == vm_status_exited;
 }
 
+void vm_stop(struct vmstate *vm) {
+    __atomic_store_n(&vm->stop_requested, 1, __ATOMIC_RELAXED);
+}
+
+/* Runs from address with whatever stack and frame the VM already has. */
+#define VM_EXECUTE          vm_execute
+#define VM_CHECKED          1
+#include "vm_execute.h"
+#undef VM_EXECUTE
+#undef VM_CHECKED
+
+/* As vm_execute, for verified code; see vm_verify.c */
+#define VM_EXECUTE          vm_execute_verified
+#define VM_CHECKED          0
+#include "vm_execute.h"
+#undef VM_EXECUTE
+#undef VM_CHECKED
+
+/* ************************************************************************* *
+ * INPUT AND OUTPUT                                                          *
+ * ************************************************************************* */
+/* gets is in vm_input.c and the output operations in vm_output.c. */
+
+
 int vm_free(struct vmstate *vm) {
+#ifdef TOYVM_PROFILE
+    vm_profile_report(vm, stderr);
+    vm_profile_free(vm);
+#endif
+    vm_jit_free(vm);
+    vm_image_unmap_state(vm);
+    vm_verify_free(vm);
+    vm_decode_free(vm);
+    vm_dirty_free(vm);
+    vm_export_free(vm);
+    vm_output_free(vm);
+    vm_input_free(vm);
+    vm_frames_free(vm);
+    vm_stats_free(vm);
+    vm_guard_free(vm);
     return 1;
 }
 
@@ -246,18 +448,97 @@ int vm_read_word(struct vmstate *vm, unsigned address) {
 }
 
 void vm_store_byte(struct vmstate *vm, unsigned address, unsigned value) {
+    vm_mem_written(vm, address, 1);
     vm->fixed_memory[address] = value & 0xFF;
 }
 
 void vm_store_short(struct vmstate *vm, unsigned address, unsigned value) {
+    vm_mem_written(vm, address, 2);
     vm->fixed_memory[address]     = value & 0xFF;
     vm->fixed_memory[address + 1] = (value >> 8) & 0xFF;
 }
 
 void vm_store_word(struct vmstate *vm, unsigned address, unsigned value) {
+    vm_mem_written(vm, address, 4);
     vm->fixed_memory[address]     = value & 0xFF;
     vm->fixed_memory[address + 1] = (value >> 8)  & 0xFF;
     vm->fixed_memory[address + 2] = (value >> 16) & 0xFF;
     vm->fixed_memory[address + 3] = (value >> 24) & 0xFF;
 }
 
+/* The bulk opcodes check their whole range once, reporting it against
+ * vm->pc if any of it is outside memory, and leave the bytes to the C
+ * library's routines. */
+static int mem_range_ok(struct vmstate *vm, unsigned address, unsigned size) {
+    if (size > vm->memory_size || address > vm->memory_size - size) {
+        fprintf(stderr,
+                "Instruction at 0x%08X accessed memory outside memory sized 0x%08X\n",
+                vm->pc, vm->memory_size);
+        return 0;
+    }
+    return 1;
+}
+
+/* Like vm_mem_written, for a range of any size: only a range that covers
+ * decoded or verified code needs vm_invalidate. */
+static void mem_range_written(struct vmstate *vm, unsigned address, unsigned size) {
+    const unsigned char *code_marks = &vm->code_marks[address];
+    uint64_t marks = 0, chunk;
+    unsigned i = 0;
+    if (size == 0) return;
+    vm_mark_dirty(vm, address, size);
+    for (; i + sizeof(chunk) <= size; i += sizeof(chunk)) {
+        memcpy(&chunk, &code_marks[i], sizeof(chunk));
+        marks |= chunk;
+    }
+    for (; i < size; ++i) {
+        marks |= code_marks[i];
+    }
+    if (marks) {
+        vm_invalidate(vm, address, size);
+    }
+    VM_STAT_ADD(vm->stats->bytes_written, size);
+}
+
+int vm_mem_copy(struct vmstate *vm, unsigned dest, unsigned src, unsigned size) {
+    if (!mem_range_ok(vm, dest, size) || !mem_range_ok(vm, src, size)) {
+        return 0;
+    }
+    memmove(&vm->fixed_memory[dest], &vm->fixed_memory[src], size);
+    VM_STAT_ADD(vm->stats->bytes_read, size);
+    mem_range_written(vm, dest, size);
+    return 1;
+}
+
+int vm_mem_fill(struct vmstate *vm, unsigned dest, unsigned value, unsigned size) {
+    if (!mem_range_ok(vm, dest, size)) {
+        return 0;
+    }
+    memset(&vm->fixed_memory[dest], value & 0xFF, size);
+    mem_range_written(vm, dest, size);
+    return 1;
+}
+
+int vm_mem_compare(struct vmstate *vm, unsigned a, unsigned b, unsigned size,
+                   int *result) {
+    if (!mem_range_ok(vm, a, size) || !mem_range_ok(vm, b, size)) {
+        return 0;
+    }
+    int order = memcmp(&vm->fixed_memory[a], &vm->fixed_memory[b], size);
+    *result = order < 0 ? -1 : order > 0;
+    VM_STAT_ADD(vm->stats->bytes_read, 2ull * size);
+    return 1;
+}
+
+int vm_mem_find(struct vmstate *vm, unsigned address, unsigned value,
+                unsigned size, unsigned *found) {
+    if (!mem_range_ok(vm, address, size)) {
+        return 0;
+    }
+    const unsigned char *start = &vm->fixed_memory[address];
+    const unsigned char *match = memchr(start, value & 0xFF, size);
+    *found = match ? address + (unsigned)(match - start) : 0xFFFFFFFF;
+    VM_STAT_ADD(vm->stats->bytes_read, match ? (unsigned)(match - start) + 1 : size);
+    return 1;
+}
+